@@ -0,0 +1,51 @@
+// Cycle count of the Internet checksum kernels under z88dk-ticks, see
+// build/bench.sh
+//
+// Built once against the C kernels and once with IP_CSUM_ASM. BENCH_IP_HDR
+// and BENCH_PSEUDO select the fixed length variants instead of checksum().
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../slip.h"
+#include "../ip.h"
+
+#define BENCH_LEN 536
+
+uint8_t bench_data[BENCH_LEN];
+
+int bdos(int func, int arg) {
+  return 0;
+}
+
+int main(void) {
+  struct ip_hdr *iph = (struct ip_hdr *)bench_data;
+  uint16_t i;
+  uint16_t sum = 0;
+
+  for (i = 0; i < BENCH_LEN; i++) {
+    bench_data[i] = rand();
+  }
+
+  for (i = 0; i < BENCH_RUNS; i++) {
+    #if defined(BENCH_IP_HDR)
+    sum += checksum_ip_hdr(iph);
+    #elif defined(BENCH_PSEUDO)
+    sum += checksum_pseudo(iph, BENCH_LEN);
+    #else
+    sum += checksum((uint16_t *)bench_data, BENCH_LEN, 0);
+    #endif
+  }
+
+  #if defined(BENCH_IP_HDR)
+  printf("bytes %u\n", BENCH_RUNS * 20);
+  #elif defined(BENCH_PSEUDO)
+  printf("bytes %u\n", BENCH_RUNS * 12);
+  #else
+  printf("bytes %u\n", BENCH_RUNS * BENCH_LEN);
+  #endif
+
+  printf("sum %04x\n", sum);
+
+  return 0;
+}
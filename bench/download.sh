@@ -0,0 +1,21 @@
+#!/bin/bash
+
+# Downloads a file from HTTPD through the gateway and reports the transfer
+# rate, for comparing link changes on real hardware.
+#
+#   ./bench/download.sh http://<gateway address>/RC2014.JPG [runs]
+
+URL=${1:?usage: $0 url [runs]}
+RUNS=${2:-5}
+
+total=0
+
+for i in $(seq $RUNS); do
+  rate=$(curl -s -o /dev/null -w '%{speed_download}' "$URL") || exit 1
+  rate=${rate%.*}
+  total=$(( total + rate ))
+
+  echo "run $i: $rate bytes/sec"
+done
+
+echo "mean: $(( total / RUNS )) bytes/sec over $RUNS runs"
@@ -0,0 +1,41 @@
+// Cycle count of an idle pass of the httpd main loop under z88dk-ticks, see
+// build/bench.sh
+//
+// Nothing arrives on the serial port, so each pass is what clock_poll()
+// counts when built without CLOCK_CTC. CLOCK_LOOP_PASSES is the CPU clock
+// divided by CLOCK_HZ and by this figure.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../slip.h"
+#include "../clock.h"
+#include "../ip.h"
+#include "../tcp.h"
+
+// Keep the stack clear of the BIOS ring at the top of memory
+#pragma output REGISTER_SP = 0xFF00
+
+int bdos(int func, int arg) {
+  return 0;
+}
+
+int main(void) {
+  uint16_t i;
+
+  *(uint8_t **)BIOS_RX_RDPTR = (uint8_t *)BIOS_RX_BUF;
+  *(uint8_t *)BIOS_RX_BUFUSED = 0;
+
+  clock_init();
+  ip_init();
+
+  for (i = 0; i < BENCH_RUNS; i++) {
+    slip_rx();
+    clock_poll();
+    tcp_poll();
+  }
+
+  printf("passes %u\n", BENCH_RUNS);
+
+  return 0;
+}
@@ -0,0 +1,409 @@
+// Host check of the gateway's flow control, see build/slip_flow.sh
+//
+// slip_flow.h is driven through a pseudo-terminal. The master end is the
+// gateway's UART and the slave end the RC2014's SIO, whose side is emulated
+// by rc_step(): a receive ring the size of the BIOS one, drained by a
+// program that can be made busy, credit frames sent back the way slip.c
+// sends them and RTS dropped as the ring fills. Time only moves while the
+// gateway polls, a millisecond at a time, so timeouts are exact.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <termios.h>
+#include <pty.h>
+
+#include "../esp8266-slip-gateway/slip_flow.h"
+
+#define SLIP_END     0xC0
+#define SLIP_ESC     0xDB
+#define SLIP_ESC_END 0xDC
+#define SLIP_ESC_ESC 0xDD
+
+#define SLIP_CREDIT 0x01
+
+// As in slip.h
+#define RC_RING 60
+#define RC_CREDIT_WINDOW 60
+#define RC_CREDIT_UPDATE 30
+
+int gw_fd;
+int rc_fd;
+uint32_t now;
+
+// Bytes each way that have been written to the pty but not read yet
+uint32_t wire_written;
+uint32_t wire_read;
+uint32_t back_written;
+uint32_t back_read;
+
+struct {
+  uint8_t ring;
+  uint8_t rts;
+  bool credits;
+  uint32_t busy_until;
+  uint32_t mute_until; // No credit frames before then
+  uint8_t drain; // Bytes taken off the ring per millisecond, when not busy
+  uint16_t consumed;
+  uint16_t credited;
+  uint8_t expect; // Next byte of the gateway's counting pattern
+  uint32_t overruns;
+  uint32_t corrupt;
+  uint32_t max_queued;
+} rc;
+
+uint8_t gw_frame[8];
+uint8_t gw_frame_len;
+bool gw_esc;
+uint8_t gw_next;
+uint8_t gw_starts; // Credits taken as the RC2014 starting
+
+SlipFlow flow;
+
+int failures;
+
+void check(bool ok, const char *what) {
+  printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+
+  if (!ok) {
+    failures++;
+  }
+}
+
+void pty_write(int fd, const uint8_t *data, size_t len) {
+  if (write(fd, data, len) != (ssize_t)len) {
+    perror("write");
+    exit(2);
+  }
+}
+
+// Reads block until the whole count has come through the pty, so nothing
+// depends on how quickly the kernel passes it on
+void pty_read(int fd, uint8_t *data, size_t len) {
+  ssize_t n;
+
+  while (len > 0) {
+    n = read(fd, data, len);
+
+    if (n <= 0) {
+      perror("read");
+      exit(2);
+    }
+
+    data += n;
+    len -= n;
+  }
+}
+
+void rc_credit() {
+  uint8_t frame[] = { SLIP_END, SLIP_CREDIT, (uint8_t)(rc.consumed >> 8), (uint8_t)rc.consumed, RC_CREDIT_WINDOW, SLIP_END };
+
+  // The counts and window here never need escaping
+  pty_write(rc_fd, frame, sizeof(frame));
+  back_written += sizeof(frame);
+
+  rc.credited = rc.consumed;
+}
+
+// A millisecond on the RC2014. Whatever is on the wire lands in the ring,
+// or is lost if there's no room, then the program takes its share.
+void rc_step() {
+  uint8_t b;
+
+  while (wire_read < wire_written) {
+    pty_read(rc_fd, &b, 1);
+    wire_read++;
+
+    if (rc.ring == RC_RING) {
+      rc.overruns++;
+      continue;
+    }
+
+    rc.ring++;
+
+    if (b != rc.expect++) {
+      rc.corrupt++;
+    }
+  }
+
+  if (now >= rc.busy_until) {
+    b = rc.ring < rc.drain ? rc.ring : rc.drain;
+
+    rc.ring -= b;
+    rc.consumed += b;
+
+    // A credit once enough has been taken, or when the ring runs dry with
+    // some still to be handed back
+    if (!rc.credits || now < rc.mute_until) {
+      // Nothing to say
+    } else if ((uint16_t)(rc.consumed - rc.credited) >= RC_CREDIT_UPDATE) {
+      rc_credit();
+    } else if (rc.ring == 0 && rc.consumed != rc.credited) {
+      rc_credit();
+    }
+  }
+
+  rc.rts = rc.ring + SLIP_FLOW_CTS_QUEUE < RC_RING;
+}
+
+void rc_restart() {
+  rc.ring = 0;
+  rc.consumed = 0;
+  rc.credited = 0;
+
+  if (rc.credits) {
+    rc_credit();
+  }
+}
+
+void gw_write(uint8_t b) {
+  uint32_t queued = wire_written - wire_read;
+
+  if (queued + 1 > rc.max_queued) {
+    rc.max_queued = queued + 1;
+  }
+
+  pty_write(gw_fd, &b, 1);
+  wire_written++;
+}
+
+size_t gw_queued() {
+  return wire_written - wire_read;
+}
+
+bool gw_clear_to_send() {
+  return rc.rts;
+}
+
+// Take in credit frames the way slipRxPacket() does
+void gw_poll() {
+  uint8_t b;
+
+  now++;
+  rc_step();
+
+  while (back_read < back_written) {
+    pty_read(gw_fd, &b, 1);
+    back_read++;
+
+    if (b == SLIP_END) {
+      if (gw_frame_len == 4 && gw_frame[0] == SLIP_CREDIT) {
+        if (flow.credit.update((gw_frame[1] << 8) | gw_frame[2], gw_frame[3])) {
+          gw_starts++;
+        }
+      }
+
+      gw_frame_len = 0;
+    } else if (b == SLIP_ESC) {
+      gw_esc = true;
+    } else {
+      if (gw_esc) {
+        b = b == SLIP_ESC_END ? SLIP_END : SLIP_ESC;
+        gw_esc = false;
+      }
+
+      if (gw_frame_len < sizeof(gw_frame)) {
+        gw_frame[gw_frame_len++] = b;
+      }
+    }
+  }
+}
+
+uint32_t gw_millis() {
+  return now;
+}
+
+const SlipFlowPort gw_port = {
+  gw_write,
+  gw_queued,
+  gw_clear_to_send,
+  gw_poll,
+  gw_millis
+};
+
+void gw_send(uint32_t len) {
+  while (len-- > 0) {
+    flow.write(gw_next++);
+  }
+}
+
+// Let the RC2014 catch up
+void settle(uint32_t ms) {
+  while (ms-- > 0) {
+    gw_poll();
+  }
+}
+
+void begin(bool cts, bool credits, uint8_t drain) {
+  memset(&rc, 0, sizeof(rc));
+  rc.credits = credits;
+  rc.drain = drain;
+  rc.rts = 1;
+  gw_next = 0;
+  gw_starts = 0;
+
+  flow.begin(&gw_port, cts);
+
+  // slip_init() sends the first credit
+  if (credits) {
+    rc_credit();
+  }
+
+  gw_poll();
+}
+
+// The gateway stops at the window while the RC2014 is busy and carries on
+// as soon as credit comes back, without waiting for the timeout
+void test_credit_exhausted() {
+  uint32_t start;
+
+  printf("credit exhausted\n");
+
+  begin(false, true, 4);
+  rc.busy_until = now + 200;
+  start = now;
+
+  gw_send(300);
+  settle(100);
+
+  check(rc.overruns == 0 && rc.corrupt == 0, "no bytes lost");
+  check(rc.consumed == 300, "everything delivered");
+  check(rc.max_queued <= RC_CREDIT_WINDOW, "never more than the window on the wire");
+  check(now - start < SLIP_FLOW_TIMEOUT_MS, "no timeout while credit kept coming");
+  check(!flow.paced(), "still on credit");
+}
+
+// Credit that stops coming sends the gateway back to pacing, and the next
+// credit frame puts it back on credit with its count still right, taking in
+// what was sent meanwhile
+void test_credit_timeout() {
+  uint32_t start;
+
+  printf("credit timeout\n");
+
+  begin(false, true, 4);
+  rc.mute_until = now + 1500;
+  start = now;
+
+  gw_send(RC_CREDIT_WINDOW);
+  check(!flow.paced(), "window sent on credit");
+
+  gw_send(1);
+  check(flow.paced(), "paced once credit stops");
+  check(now - start >= SLIP_FLOW_TIMEOUT_MS, "after the timeout");
+
+  gw_send(20);
+  settle(600);
+  check(!flow.paced(), "back on credit when it arrives");
+  check(flow.credit.sent == rc.consumed, "count kept while paced");
+
+  gw_send(300);
+  settle(100);
+
+  check(rc.overruns == 0 && rc.corrupt == 0, "no bytes lost");
+  check(rc.consumed == RC_CREDIT_WINDOW + 1 + 20 + 300, "everything delivered");
+  check(gw_starts == 1, "not taken for a restart");
+}
+
+// An RC2014 that restarts counts from zero again. Once the gateway has sent
+// more than the resync threshold that's spotted from the first credit.
+void test_restart() {
+  uint32_t start;
+
+  printf("restart\n");
+
+  begin(false, true, 30);
+
+  gw_send(5000);
+  settle(10);
+  check(rc.consumed == 5000, "sent before the restart");
+
+  rc_restart();
+  gw_poll();
+  check(flow.credit.available() == RC_CREDIT_WINDOW, "full window after the restart");
+  check(gw_starts == 2, "restart reported");
+
+  start = now;
+  gw_send(300);
+  settle(10);
+
+  check(rc.overruns == 0, "no bytes lost after the restart");
+  check(now - start < SLIP_FLOW_TIMEOUT_MS, "no timeout after the restart");
+}
+
+// Before the gateway has sent enough to trip the threshold, a restart is
+// spotted by the RC2014's count going backwards
+void test_early_restart() {
+  uint32_t start;
+
+  printf("early restart\n");
+
+  begin(false, true, 30);
+
+  gw_send(100);
+  settle(10);
+
+  rc_restart();
+  gw_poll();
+  check(gw_starts == 2, "restart reported");
+
+  start = now;
+  gw_send(300);
+  settle(10);
+
+  check(rc.overruns == 0, "no bytes lost after the restart");
+  check(now - start < SLIP_FLOW_TIMEOUT_MS, "no timeout after the restart");
+}
+
+// With CTS the gateway keeps no more than SLIP_FLOW_CTS_QUEUE bytes on the
+// wire, which is all the RC2014 has to find room for after dropping RTS
+void test_cts() {
+  uint32_t start;
+
+  printf("cts\n");
+
+  begin(true, false, 1);
+  rc.busy_until = now + 50;
+
+  check(!flow.paced(), "not paced with CTS");
+
+  gw_send(500);
+  settle(100);
+
+  check(rc.overruns == 0 && rc.corrupt == 0, "no bytes lost");
+  check(rc.max_queued <= SLIP_FLOW_CTS_QUEUE, "queue limit kept");
+  check(rc.consumed == 500, "everything delivered");
+
+  // RTS held down by something that's stopped listening
+  rc.busy_until = (uint32_t)-1;
+  gw_send(RC_RING);
+
+  start = now;
+  gw_send(1);
+  check(now - start >= SLIP_FLOW_TIMEOUT_MS, "gives up on a line that stays down");
+}
+
+int main() {
+  struct termios tio;
+
+  if (openpty(&gw_fd, &rc_fd, NULL, NULL, NULL) < 0) {
+    perror("openpty");
+    return 2;
+  }
+
+  // Bytes have to get through untouched
+  tcgetattr(rc_fd, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(rc_fd, TCSANOW, &tio);
+
+  test_credit_exhausted();
+  test_credit_timeout();
+  test_restart();
+  test_early_restart();
+  test_cts();
+
+  printf("%d failed\n", failures);
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,101 @@
+// Cycle count of the SLIP receive path under z88dk-ticks, see build/bench.sh
+//
+// Built once against the BDOS path and once with SLIP_BIOS_RING. The
+// serial interrupt handler is emulated by bench_isr() which tops up the
+// BIOS ring whenever it runs dry. The BDOS build reads the ring the same
+// way the BIOS conin routine does, but the BDOS dispatch itself can't be
+// simulated, so its figure is a lower bound.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../slip.h"
+#include "../ip.h"
+
+// Keep the stack clear of the BIOS ring at the top of memory
+#pragma output REGISTER_SP = 0xFF00
+
+#define BENCH_FRAME_LEN 576
+
+uint8_t bench_frame[BENCH_FRAME_LEN + 2];
+uint16_t bench_frame_pos;
+uint16_t bench_frames;
+
+uint8_t *bench_wrptr;
+
+void bench_isr(void) {
+  uint8_t *used = (uint8_t *)BIOS_RX_BUFUSED;
+
+  while (*used < BIOS_RX_BUFSIZE) {
+    *bench_wrptr++ = bench_frame[bench_frame_pos++];
+
+    if (bench_wrptr == (uint8_t *)(BIOS_RX_BUF + BIOS_RX_BUFSIZE)) {
+      bench_wrptr = (uint8_t *)BIOS_RX_BUF;
+    }
+
+    if (bench_frame_pos == sizeof(bench_frame)) {
+      bench_frame_pos = 0;
+    }
+
+    (*used)++;
+  }
+}
+
+int bdos(int func, int arg) {
+  uint8_t **rdptr = (uint8_t **)BIOS_RX_RDPTR;
+  uint8_t c;
+
+  if (*(uint8_t *)BIOS_RX_BUFUSED == 0) {
+    bench_isr();
+  }
+
+  if (func != CPM_RRDR) {
+    return 0;
+  }
+
+  c = *(*rdptr)++;
+
+  if (*rdptr == (uint8_t *)(BIOS_RX_BUF + BIOS_RX_BUFSIZE)) {
+    *rdptr = (uint8_t *)BIOS_RX_BUF;
+  }
+
+  (*(uint8_t *)BIOS_RX_BUFUSED)--;
+
+  return c;
+}
+
+void ip_rx(struct ip_hdr *iph) {
+  bench_frames++;
+}
+
+int main(void) {
+  uint16_t i;
+
+  // A full MTU frame with the usual sprinkling of bytes that need escaping
+  bench_frame[0] = SLIP_END;
+
+  for (i = 1; i <= BENCH_FRAME_LEN; i++) {
+    switch (i % 64) {
+      case 0: bench_frame[i] = SLIP_ESC; break;
+      case 1: bench_frame[i] = SLIP_ESC_END; break;
+      default: bench_frame[i] = i & 0x7F;
+    }
+  }
+
+  bench_frame[BENCH_FRAME_LEN + 1] = SLIP_END;
+
+  *(uint8_t **)BIOS_RX_RDPTR = (uint8_t *)BIOS_RX_BUF;
+  *(uint8_t *)BIOS_RX_BUFUSED = 0;
+  bench_wrptr = (uint8_t *)BIOS_RX_BUF;
+
+  slip_init();
+
+  while (bench_frames < BENCH_RUNS) {
+    bench_isr();
+    slip_rx();
+  }
+
+  printf("bytes %u\n", BENCH_RUNS * (uint16_t)sizeof(bench_frame));
+
+  return 0;
+}
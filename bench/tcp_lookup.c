@@ -0,0 +1,59 @@
+// Cycle count of the TCP socket lookup under z88dk-ticks, see build/bench.sh
+//
+// Built with TCP_MAX_SOCKETS set to 16, 32 and 64. Every socket is opened
+// with tcp_connect(), then tcp_sock_get() is asked for each of them in turn
+// with the headers of a segment the peer would send back.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../slip.h"
+#include "../ip.h"
+#include "../tcp.h"
+
+uint8_t bench_packets[TCP_MAX_SOCKETS][40];
+
+int bdos(int func, int arg) {
+  return 0;
+}
+
+int main(void) {
+  struct tcp_sock *s;
+  struct ip_hdr *iph;
+  struct tcp_hdr *tcph;
+  uint8_t addr[4] = { 10, 0, 0, 0 };
+  uint16_t i;
+  uint16_t j;
+  uint16_t found = 0;
+
+  ip_init();
+
+  for (i = 0; i < TCP_MAX_SOCKETS; i++) {
+    addr[3] = i;
+
+    s = tcp_connect(addr, 80, NULL, NULL, NULL, NULL);
+
+    iph = (struct ip_hdr *)bench_packets[i];
+    tcph = (struct tcp_hdr *)(iph + 1);
+
+    iph->version_ihl = 0x45;
+    memcpy(iph->saddr, s->daddr, 4);
+    memcpy(iph->daddr, s->saddr, 4);
+
+    tcph->sport = htons(s->dport);
+    tcph->dport = htons(s->sport);
+  }
+
+  for (j = 0; j < BENCH_RUNS; j++) {
+    for (i = 0; i < TCP_MAX_SOCKETS; i++) {
+      if (tcp_sock_get((struct ip_hdr *)bench_packets[i])) {
+        found++;
+      }
+    }
+  }
+
+  printf("lookups %u\n", BENCH_RUNS * TCP_MAX_SOCKETS);
+  printf("found %u\n", found);
+
+  return 0;
+}
@@ -0,0 +1,42 @@
+#!/bin/bash
+
+# Runs the benchmarks in bench/ under z88dk-ticks and reports T-states per byte,
+# or per whatever unit the benchmark counts. Every variant is built twice, with BENCH_RUNS=0 and BENCH_RUNS=$RUNS, and the
+# difference between the two runs is what gets reported.
+
+RUNS=${RUNS:-100}
+OUT=${OUT:-/tmp/rc2014-bench}
+
+mkdir -p $OUT
+
+bench() {
+  local name=$1
+  shift
+
+  zcc +test -O3 -DAMALLOC -DCPM_RRDR=3 -DCPM_WPUN=4 -DBENCH_RUNS=0 "$@" -o $OUT/$name-0.bin &&
+  zcc +test -O3 -DAMALLOC -DCPM_RRDR=3 -DCPM_WPUN=4 -DBENCH_RUNS=$RUNS "$@" -o $OUT/$name-n.bin || return 1
+
+  local t0=$(z88dk-ticks $OUT/$name-0.bin | tail -1 | tr -dc 0-9)
+  local tn=$(z88dk-ticks $OUT/$name-n.bin | tail -1 | tr -dc 0-9)
+  local unit=$(z88dk-ticks $OUT/$name-n.bin | awk '/^(bytes|lookups|passes) / { print $1 }')
+  local count=$(z88dk-ticks $OUT/$name-n.bin | awk '/^(bytes|lookups|passes) / { print $2 }')
+
+  echo "$name: $(( (tn - t0) / count )) T-states/${unit%s} ($(( tn - t0 )) over $count $unit)"
+}
+
+bench slip_rx_bdos bench/slip_rx.c slip.c
+bench slip_rx_ring -DSLIP_BIOS_RING bench/slip_rx.c slip.c
+
+bench checksum_c bench/checksum.c ip.c slip.c
+bench checksum_asm -DIP_CSUM_ASM bench/checksum.c ip.c slip.c
+bench checksum_ip_hdr_c -DBENCH_IP_HDR bench/checksum.c ip.c slip.c
+bench checksum_ip_hdr_asm -DBENCH_IP_HDR -DIP_CSUM_ASM bench/checksum.c ip.c slip.c
+bench checksum_pseudo_c -DBENCH_PSEUDO bench/checksum.c ip.c slip.c
+bench checksum_pseudo_asm -DBENCH_PSEUDO -DIP_CSUM_ASM bench/checksum.c ip.c slip.c
+
+for sockets in 16 32 64; do
+  bench tcp_lookup_$sockets -DENABLE_TCP -DTCP_MAX_SOCKETS=$sockets -DTCP_SOCK_HASH=$sockets bench/tcp_lookup.c tcp.c clock.c ip.c slip.c
+  bench tcp_lookup_${sockets}_unhashed -DENABLE_TCP -DTCP_MAX_SOCKETS=$sockets -DTCP_SOCK_HASH=1 bench/tcp_lookup.c tcp.c clock.c ip.c slip.c
+done
+
+bench idle_loop -DSLIP_BIOS_RING -DENABLE_TCP bench/idle_loop.c clock.c tcp.c ip.c slip.c
@@ -1,4 +1,4 @@
 #!/bin/bash
 
-zcc +cpm -O3 -DAMALLOC -DENABLE_TCP httpd.c slip.c ip.c tcp.c http.c -o ./bin/httpd.com -create-app &&
+zcc +cpm -O3 -DAMALLOC -DSLIP_BIOS_RING -DSLIP_SIO_TX -DIP_CSUM_ASM -DSLIP_CSLIP -DENABLE_TCP httpd.c slip.c cslip.c clock.c ip.c tcp.c http.c -o ./bin/httpd.com -create-app &&
 ruby ~/Workspace/rc2014-package/rc2014-package.rb ./bin/HTTPD.COM
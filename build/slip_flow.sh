@@ -0,0 +1,10 @@
+#!/bin/bash
+
+# Builds the gateway's flow control in esp8266-slip-gateway/slip_flow.h for
+# the host and checks it against a pseudo-terminal, see bench/slip_flow.cpp
+
+OUT=${OUT:-/tmp/rc2014-bench}
+
+mkdir -p $OUT
+
+g++ -O2 -Wall bench/slip_flow.cpp -lutil -o $OUT/slip_flow && $OUT/slip_flow
@@ -0,0 +1,65 @@
+#include <stdlib.h>
+#include "clock.h"
+
+uint16_t clock_ticks;
+
+#ifdef CLOCK_CTC
+static uint8_t clock_ctc_last;
+static uint8_t clock_ctc_odd;
+
+void clock_ctc_init(void) __naked {
+  __asm
+    ld a,CLOCK_CTC_TIMER
+    out (CLOCK_CTC_CH0),a
+    ld a,CLOCK_CTC_TC
+    out (CLOCK_CTC_CH0),a
+    ld a,CLOCK_CTC_COUNTER
+    out (CLOCK_CTC_CH1),a
+    xor a
+    out (CLOCK_CTC_CH1),a
+    ret
+  __endasm;
+}
+
+uint8_t clock_ctc_read(void) __naked {
+  __asm
+    in a,(CLOCK_CTC_CH1)
+    ld l,a
+    ld h,0
+    ret
+  __endasm;
+}
+#else
+static uint8_t clock_passes;
+#endif
+
+void clock_init(void) {
+  clock_ticks = 0;
+
+  #ifdef CLOCK_CTC
+  clock_ctc_init();
+  clock_ctc_last = clock_ctc_read();
+  #endif
+}
+
+// Bring clock_ticks up to date. Called on every pass of the main loop.
+void clock_poll(void) {
+  #ifdef CLOCK_CTC
+  uint8_t now = clock_ctc_read();
+  uint16_t pulses;
+
+  // Channel 1 counts down, two pulses to a tick
+  pulses = clock_ctc_odd + (uint8_t)(clock_ctc_last - now);
+  clock_ctc_last = now;
+  clock_ctc_odd = pulses & 1;
+
+  clock_ticks += pulses >> 1;
+  #else
+  if (++clock_passes < CLOCK_LOOP_PASSES) {
+    return;
+  }
+
+  clock_passes = 0;
+  clock_ticks++;
+  #endif
+}
@@ -0,0 +1,33 @@
+#ifndef __CLOCK_H__
+#define __CLOCK_H__
+
+#define CLOCK_HZ 100 // clock_ticks per second
+
+// With CLOCK_CTC defined time comes from a Z80 CTC. Channel 0 divides the
+// 7.3728MHz system clock down to 200Hz and channel 1, with its CLK/TRG
+// input jumpered to ZC/TO0, counts those pulses. Channel 1 wraps every
+// 1.28s, so clock_poll() has to be called at least that often.
+#ifndef CLOCK_CTC_PORT
+#define CLOCK_CTC_PORT 0x88
+#endif
+#define CLOCK_CTC_CH0 CLOCK_CTC_PORT
+#define CLOCK_CTC_CH1 CLOCK_CTC_PORT+1
+#define CLOCK_CTC_TIMER 0x27 // Timer, prescaler 256, time constant follows, reset
+#define CLOCK_CTC_COUNTER 0x47 // Counter, time constant follows, reset
+#define CLOCK_CTC_TC 144 // 7372800 / 256 / 144 = 200Hz
+
+// Without it there's nothing to measure time against, so a tick is counted
+// every CLOCK_LOOP_PASSES calls of clock_poll(). That's about 10ms of idle
+// main loop at 7.3728MHz; build/bench.sh measures a pass so it can be set
+// for another CPU clock. Passes that handle a frame take longer, so this
+// clock runs slow while the stack is busy.
+#ifndef CLOCK_LOOP_PASSES
+#define CLOCK_LOOP_PASSES 128
+#endif
+
+extern uint16_t clock_ticks;
+
+void clock_init(void);
+void clock_poll(void);
+
+#endif
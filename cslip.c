@@ -0,0 +1,445 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "slip.h"
+#include "ip.h"
+#include "tcp.h"
+#include "cslip.h"
+
+// State of every connection seen in each direction. A compressed header only
+// carries what changed since the last one on the same slot.
+struct cslip_rx_state *cslip_rx_slots;
+struct cslip_tx_state *cslip_tx_slots;
+
+uint8_t cslip_rx_last;
+uint8_t cslip_tx_last;
+uint16_t cslip_tx_clock;
+
+// Set once a frame has been lost, since the deltas that follow it can't be
+// applied until the gateway sends a slot number again
+uint8_t cslip_rx_toss;
+
+// Read position in the compressed header being expanded
+static uint8_t *cslip_rx_cp;
+
+void cslip_init(void) {
+  cslip_rx_slots = calloc(CSLIP_SLOTS, sizeof(struct cslip_rx_state));
+  cslip_tx_slots = calloc(CSLIP_SLOTS, sizeof(struct cslip_tx_state));
+
+  cslip_rx_last = 0;
+  cslip_tx_last = 0xFF;
+  cslip_tx_clock = 0;
+  cslip_rx_toss = 1;
+}
+
+// Replace the 16 bits "from" with "to" in a ones-complement sum (RFC 1624)
+static uint16_t cslip_sum_replace(uint16_t sum, uint16_t from, uint16_t to) {
+  return checksum_add(checksum_add(sum, ~from), to);
+}
+
+// Deltas go out as a single byte when they fit in 1-255 and as a zero byte
+// followed by 16 bits in network byte order otherwise
+static uint8_t *cslip_encode(uint8_t *p, uint16_t n) {
+  if (n == 0 || n > 255) {
+    *p++ = 0;
+    *p++ = n >> 8;
+  }
+
+  *p++ = n;
+
+  return p;
+}
+
+static uint16_t cslip_decode(void) {
+  uint16_t n = *cslip_rx_cp++;
+
+  if (n == 0) {
+    n = (uint16_t)cslip_rx_cp[0] << 8 | cslip_rx_cp[1];
+    cslip_rx_cp += 2;
+  }
+
+  return n;
+}
+
+// Add a delta to a 16 or 32 bit field held in network byte order
+static void cslip_add16(uint16_t *field, uint16_t n) {
+  *field = htons(ntohs(*field) + n);
+}
+
+static void cslip_add32(uint32_t *field, uint16_t n) {
+  *field = htonl(ntohl(*field) + n);
+}
+
+// UNCOMPRESSED_TCP is a whole packet with the slot number in place of the
+// protocol. It resets the state of that slot.
+static struct ip_hdr *cslip_rx_uncompressed(struct slip_frame *f) {
+  uint8_t *data = f->data;
+  uint8_t slot = data[9];
+  uint8_t type = data[0];
+  uint8_t hlen;
+  uint16_t from, to;
+  struct cslip_rx_state *rs;
+
+  if (slot >= CSLIP_SLOTS || f->len < 40) {
+    cslip_rx_toss = 1;
+    return NULL;
+  }
+
+  hlen = (data[0] & 0x0F) * 4;
+  hlen += (data[hlen + 12] >> 4) * 4;
+
+  if (hlen > CSLIP_HDR_MAX || hlen > f->len) {
+    cslip_rx_toss = 1;
+    return NULL;
+  }
+
+  data[0] = (data[0] & 0x0F) | (IPV4 << 4);
+  data[9] = TCP;
+
+  // Byte 0 is the low half of its word and byte 9 the high half of its
+  // own, so the two can be swapped out of the sums as if they shared one
+  from = type | (uint16_t)slot << 8;
+  to = data[0] | (uint16_t)TCP << 8;
+
+  f->csum = cslip_sum_replace(f->csum, from, to);
+  f->csum_hdr = cslip_sum_replace(f->csum_hdr, from, to);
+
+  rs = &cslip_rx_slots[slot];
+  rs->hlen = hlen;
+  memcpy(rs->hdr, data, hlen);
+
+  cslip_rx_last = slot;
+  cslip_rx_toss = 0;
+
+  return (struct ip_hdr *)data;
+}
+
+// COMPRESSED_TCP carries a change mask, the TCP checksum and whichever deltas
+// the mask calls for. The saved header is brought up to date and copied into
+// the headroom in front of the payload.
+static struct ip_hdr *cslip_rx_compressed(struct slip_frame *f) {
+  uint8_t *data = f->data;
+  uint8_t changes;
+  uint8_t n;
+  uint16_t data_len;
+  uint16_t sum;
+  uint16_t i;
+  struct cslip_rx_state *rs;
+  struct ip_hdr *iph;
+  struct tcp_hdr *tcph;
+  uint8_t *out;
+
+  cslip_rx_cp = data;
+  changes = *cslip_rx_cp++;
+
+  if (changes & CSLIP_NEW_C) {
+    if (*cslip_rx_cp >= CSLIP_SLOTS) {
+      goto bad;
+    }
+
+    cslip_rx_last = *cslip_rx_cp++;
+    cslip_rx_toss = 0;
+  } else if (cslip_rx_toss) {
+    return NULL;
+  }
+
+  rs = &cslip_rx_slots[cslip_rx_last];
+
+  if (rs->hlen == 0) {
+    goto bad;
+  }
+
+  iph = (struct ip_hdr *)rs->hdr;
+  tcph = (struct tcp_hdr *)ip_data(iph);
+
+  memcpy(&tcph->csum, cslip_rx_cp, 2);
+  cslip_rx_cp += 2;
+
+  if (changes & CSLIP_PUSH) {
+    tcph->flags |= TCP_PSH;
+  } else {
+    tcph->flags &= ~TCP_PSH;
+  }
+
+  switch (changes & CSLIP_SPECIALS_MASK) {
+    case CSLIP_SPECIAL_I:
+      i = ntohs(iph->len) - rs->hlen;
+      cslip_add32(&tcph->ack_seq, i);
+      cslip_add32(&tcph->seq, i);
+      break;
+
+    case CSLIP_SPECIAL_D:
+      cslip_add32(&tcph->seq, ntohs(iph->len) - rs->hlen);
+      break;
+
+    default:
+      if (changes & CSLIP_NEW_U) {
+        tcph->flags |= TCP_URG;
+        tcph->urp = htons(cslip_decode());
+      } else {
+        tcph->flags &= ~TCP_URG;
+      }
+
+      if (changes & CSLIP_NEW_W) {
+        cslip_add16(&tcph->win, cslip_decode());
+      }
+
+      if (changes & CSLIP_NEW_A) {
+        cslip_add32(&tcph->ack_seq, cslip_decode());
+      }
+
+      if (changes & CSLIP_NEW_S) {
+        cslip_add32(&tcph->seq, cslip_decode());
+      }
+
+      break;
+  }
+
+  if (changes & CSLIP_NEW_I) {
+    cslip_add16(&iph->id, cslip_decode());
+  } else {
+    cslip_add16(&iph->id, 1);
+  }
+
+  n = cslip_rx_cp - data;
+
+  if (n > f->len) {
+    goto bad;
+  }
+
+  data_len = f->len - n;
+
+  iph->len = htons(data_len + rs->hlen);
+  iph->csum = 0;
+  iph->csum = (ip_hl(iph) == 20) ? checksum_ip_hdr(iph) : checksum((uint16_t *)iph, ip_hl(iph), 0);
+
+  // Take the compressed header back out of the decoder's sum to leave the
+  // payload. It moves to an even offset, so an odd length swaps its bytes.
+  sum = checksum_add(f->csum, checksum((uint16_t *)data, n, 0));
+
+  if (n & 1) {
+    sum = (sum << 8) | (sum >> 8);
+  }
+
+  // ip_rx() wants the sum of everything after the IP header
+  f->csum = checksum_add(sum, ~checksum((uint16_t *)tcph, rs->hlen - ip_hl(iph), 0));
+  f->csum_hdr = 0xFFFF;
+  f->len = data_len + rs->hlen;
+
+  out = data + n - rs->hlen;
+  memcpy(out, rs->hdr, rs->hlen);
+
+  return (struct ip_hdr *)out;
+
+bad:
+  cslip_rx_toss = 1;
+  return NULL;
+}
+
+// Expand the header of a received frame in place. Returns the packet for
+// ip_rx(), with the frame's length and sums updated to match, or NULL if it
+// has to be dropped.
+struct ip_hdr *cslip_rx(struct slip_frame *f) {
+  uint8_t type = f->data[0];
+
+  if (type & CSLIP_TYPE_COMPRESSED_TCP) {
+    return cslip_rx_compressed(f);
+  }
+
+  if (type >= CSLIP_TYPE_UNCOMPRESSED_TCP) {
+    return cslip_rx_uncompressed(f);
+  }
+
+  return (struct ip_hdr *)f->data;
+}
+
+// Find the slot for the connection "iph" belongs to, or the least recently
+// used one if it has none. For a 40 byte header the addresses and ports are
+// the 12 bytes from offset 12.
+static struct cslip_tx_state *cslip_tx_slot(struct ip_hdr *iph) {
+  struct cslip_tx_state *cs;
+  struct cslip_tx_state *lru = cslip_tx_slots;
+  uint8_t i;
+
+  for (i = 0; i < CSLIP_SLOTS; i++) {
+    cs = &cslip_tx_slots[i];
+
+    if (cs->used && !memcmp(cs->hdr + 12, (uint8_t *)iph + 12, 12)) {
+      return cs;
+    }
+
+    if (cs->used < lru->used) {
+      lru = cs;
+    }
+  }
+
+  memset(lru->hdr, 0, CSLIP_TX_HDR);
+
+  return lru;
+}
+
+// Compress the header of an outgoing TCP segment in place and send it.
+// Segments that can't be described as a delta from the last one on their
+// connection go out whole, as UNCOMPRESSED_TCP to resync the gateway.
+void cslip_tx(struct ip_hdr *iph, uint16_t len) {
+  struct tcp_hdr *tcph = (struct tcp_hdr *)(iph + 1);
+  struct cslip_tx_state *cs;
+  struct ip_hdr *oiph;
+  struct tcp_hdr *otcph;
+  uint8_t deltas[CSLIP_COMPRESSED_MAX];
+  uint8_t *p = deltas;
+  uint8_t *out;
+  uint8_t changes = 0;
+  uint8_t slot;
+  uint8_t n;
+  uint16_t csum;
+  uint16_t old_data_len;
+  uint16_t delta;
+  uint32_t delta_s;
+  uint32_t delta_a;
+
+  // Fragments, options, and anything but a plain ACK go out as IP
+  if (ip_ihl(iph) != 5 || tcph->offset != 5 || len < CSLIP_TX_HDR) {
+    slip_tx((uint8_t *)iph, len);
+    return;
+  }
+
+  if ((ntohs(iph->frag_offset) & 0x3FFF) ||
+      (tcph->flags & (TCP_SYN | TCP_FIN | TCP_RST | TCP_ACK)) != TCP_ACK) {
+    slip_tx((uint8_t *)iph, len);
+    return;
+  }
+
+  cs = cslip_tx_slot(iph);
+  cs->used = ++cslip_tx_clock;
+
+  // Wrapping the clock would make every slot look recently used
+  if (cslip_tx_clock == 0xFFFF) {
+    for (n = 0; n < CSLIP_SLOTS; n++) {
+      cslip_tx_slots[n].used = cslip_tx_slots[n].used ? 1 : 0;
+    }
+
+    cs->used = cslip_tx_clock = 2;
+  }
+
+  slot = cs - cslip_tx_slots;
+  oiph = (struct ip_hdr *)cs->hdr;
+  otcph = (struct tcp_hdr *)(oiph + 1);
+
+  // A new slot, or a change to something that's meant to stay constant
+  if (memcmp(oiph, iph, 2) || memcmp(&oiph->frag_offset, &iph->frag_offset, 4)) {
+    goto uncompressed;
+  }
+
+  if (tcph->flags & TCP_URG) {
+    p = cslip_encode(p, ntohs(tcph->urp));
+    changes |= CSLIP_NEW_U;
+  } else if (tcph->urp != otcph->urp) {
+    goto uncompressed;
+  }
+
+  delta = ntohs(tcph->win) - ntohs(otcph->win);
+
+  if (delta) {
+    p = cslip_encode(p, delta);
+    changes |= CSLIP_NEW_W;
+  }
+
+  delta_a = ntohl(tcph->ack_seq) - ntohl(otcph->ack_seq);
+
+  if (delta_a) {
+    if (delta_a > 0xFFFF) {
+      goto uncompressed;
+    }
+
+    p = cslip_encode(p, delta_a);
+    changes |= CSLIP_NEW_A;
+  }
+
+  delta_s = ntohl(tcph->seq) - ntohl(otcph->seq);
+
+  if (delta_s) {
+    if (delta_s > 0xFFFF) {
+      goto uncompressed;
+    }
+
+    p = cslip_encode(p, delta_s);
+    changes |= CSLIP_NEW_S;
+  }
+
+  old_data_len = ntohs(oiph->len) - CSLIP_TX_HDR;
+
+  switch (changes) {
+    case 0:
+      // Data following a pure ACK is normal, but a repeat of the last
+      // segment is a retransmission and the gateway may have missed it
+      if (iph->len != oiph->len && old_data_len == 0) {
+        break;
+      }
+
+      goto uncompressed;
+
+    case CSLIP_SPECIAL_I:
+    case CSLIP_SPECIAL_D:
+      goto uncompressed;
+
+    case CSLIP_NEW_S | CSLIP_NEW_A:
+      if (delta_s == delta_a && delta_s == old_data_len) {
+        changes = CSLIP_SPECIAL_I;
+        p = deltas;
+      }
+
+      break;
+
+    case CSLIP_NEW_S:
+      if (delta_s == old_data_len) {
+        changes = CSLIP_SPECIAL_D;
+        p = deltas;
+      }
+
+      break;
+  }
+
+  delta = ntohs(iph->id) - ntohs(oiph->id);
+
+  if (delta != 1) {
+    p = cslip_encode(p, delta);
+    changes |= CSLIP_NEW_I;
+  }
+
+  if (tcph->flags & TCP_PSH) {
+    changes |= CSLIP_PUSH;
+  }
+
+  csum = tcph->csum;
+  memcpy(cs->hdr, iph, CSLIP_TX_HDR);
+
+  // The compressed header is built backwards from where the payload starts,
+  // over the end of the full one
+  n = p - deltas;
+  out = (uint8_t *)iph + CSLIP_TX_HDR - n;
+  memcpy(out, deltas, n);
+
+  out -= 2;
+  memcpy(out, &csum, 2);
+
+  if (slot != cslip_tx_last) {
+    *--out = slot;
+    changes |= CSLIP_NEW_C;
+    cslip_tx_last = slot;
+  }
+
+  *--out = changes | CSLIP_TYPE_COMPRESSED_TCP;
+
+  slip_tx(out, len - (out - (uint8_t *)iph));
+  return;
+
+uncompressed:
+  memcpy(cs->hdr, iph, CSLIP_TX_HDR);
+  cslip_tx_last = slot;
+
+  iph->proto = slot;
+  iph->version_ihl |= CSLIP_TYPE_UNCOMPRESSED_TCP;
+
+  slip_tx((uint8_t *)iph, len);
+}
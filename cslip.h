@@ -0,0 +1,48 @@
+#ifndef __CSLIP_H__
+#define __CSLIP_H__
+
+// Van Jacobson TCP/IP header compression for SLIP (RFC 1144)
+
+#define CSLIP_SLOTS 16 // connection states kept for each direction
+#define CSLIP_HDR_MAX SLIP_RX_HEADROOM // longest IP + TCP header remembered
+#define CSLIP_TX_HDR 40 // only headers without options are compressed
+
+// Packet type, carried in the top bits of the first byte of a frame
+#define CSLIP_TYPE_IP 0x40
+#define CSLIP_TYPE_UNCOMPRESSED_TCP 0x70
+#define CSLIP_TYPE_COMPRESSED_TCP 0x80
+
+// Change mask, the first byte of a compressed header
+#define CSLIP_NEW_C 0x40
+#define CSLIP_NEW_I 0x20
+#define CSLIP_PUSH 0x10
+#define CSLIP_NEW_S 0x08
+#define CSLIP_NEW_A 0x04
+#define CSLIP_NEW_W 0x02
+#define CSLIP_NEW_U 0x01
+
+// Combinations that can't happen in a real change mask stand in for the
+// two common cases of echoed terminal traffic and unidirectional data
+#define CSLIP_SPECIAL_I (CSLIP_NEW_S | CSLIP_NEW_W | CSLIP_NEW_U)
+#define CSLIP_SPECIAL_D (CSLIP_NEW_S | CSLIP_NEW_A | CSLIP_NEW_W | CSLIP_NEW_U)
+#define CSLIP_SPECIALS_MASK (CSLIP_NEW_S | CSLIP_NEW_A | CSLIP_NEW_W | CSLIP_NEW_U)
+
+#define CSLIP_COMPRESSED_MAX 19 // change mask, slot, checksum and five deltas
+
+struct cslip_rx_state {
+  uint8_t hlen;
+  uint8_t hdr[CSLIP_HDR_MAX];
+};
+
+struct cslip_tx_state {
+  uint16_t used; // for picking the least recently used slot
+  uint8_t hdr[CSLIP_TX_HDR];
+};
+
+extern uint8_t cslip_rx_toss;
+
+void cslip_init(void);
+struct ip_hdr *cslip_rx(struct slip_frame *f);
+void cslip_tx(struct ip_hdr *iph, uint16_t len);
+
+#endif
@@ -13,6 +13,7 @@
  */
 
 #include <ESP8266WiFi.h>
+#include "slip_flow.h"
 
 extern "C" {
   #include "lwip/netif.h"
@@ -35,10 +36,15 @@ const IPAddress RC2014_IP(192, 168, 1, 51);
 const IPAddress SLIP_GATEWAY_IP(192, 168, 1, 1);
 const IPAddress SLIP_NETMASK(255, 255, 255, 0);
 const uint32_t SERIAL_BAUD = 115200;
+const size_t SERIAL_TX_FIFO_SIZE = 128; // ESP8266 UART hardware FIFO
 
 const int LED_WIFI = 5;
 const int LED_ACTIVITY = 4;
 
+// GPIO wired to the SIO's /RTS output for hardware flow control, or -1 to
+// rely on credit frames alone. The RC2014 has to be built with SLIP_RTS.
+const int SLIP_CTS_PIN = -1;
+
 #define SLIP_END     0xC0
 #define SLIP_ESC     0xDB
 #define SLIP_ESC_END 0xDC
@@ -49,9 +55,44 @@ const int LED_ACTIVITY = 4;
 #define SLIP_DECODE_DONE 3
 #define SLIP_DECODE_RST  4
 
+// Credit frames from the RC2014: SLIP_CREDIT, the count of bytes it has
+// taken off its serial port (16 bits, wrapping) and how many more it can take
+#define SLIP_CREDIT 0x01
+
 const size_t SLIP_MTU = 576;
 const size_t SLIP_MAX_PACKET = 1154;
 
+// Van Jacobson TCP/IP header compression (RFC 1144). The gateway always
+// accepts compressed frames and starts compressing its own as soon as the
+// RC2014 sends one, so an RC2014 built without SLIP_CSLIP keeps getting
+// plain IP. Set to false to turn it off on this side too.
+const bool CSLIP_ENABLED = true;
+const uint8_t CSLIP_SLOTS = 16; // must not exceed CSLIP_SLOTS in cslip.h
+const size_t CSLIP_HDR_MAX = 60;
+
+#define CSLIP_TYPE_IP               0x40
+#define CSLIP_TYPE_UNCOMPRESSED_TCP 0x70
+#define CSLIP_TYPE_COMPRESSED_TCP   0x80
+
+#define CSLIP_NEW_C 0x40
+#define CSLIP_NEW_I 0x20
+#define CSLIP_PUSH  0x10
+#define CSLIP_NEW_S 0x08
+#define CSLIP_NEW_A 0x04
+#define CSLIP_NEW_W 0x02
+#define CSLIP_NEW_U 0x01
+
+#define CSLIP_SPECIAL_I     (CSLIP_NEW_S | CSLIP_NEW_W | CSLIP_NEW_U)
+#define CSLIP_SPECIAL_D     (CSLIP_NEW_S | CSLIP_NEW_A | CSLIP_NEW_W | CSLIP_NEW_U)
+#define CSLIP_SPECIALS_MASK (CSLIP_NEW_S | CSLIP_NEW_A | CSLIP_NEW_W | CSLIP_NEW_U)
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+#define TCP_URG 0x20
+
 struct SlipDecoder {
   uint8_t buffer[SLIP_MAX_PACKET];
   size_t length;
@@ -105,8 +146,375 @@ struct SlipDecoder {
   }
 };
 
+// Headers are handled as bytes rather than through lwIP's structs because
+// packets come and go at arbitrary offsets in the serial buffers
+static uint16_t get16(const uint8_t *p) {
+  return (uint16_t)p[0] << 8 | p[1];
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return (uint32_t)get16(p) << 16 | get16(p + 2);
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  put16(p, v >> 16);
+  put16(p + 2, v);
+}
+
+struct CslipState {
+  uint8_t hlen;
+  uint8_t hdr[CSLIP_HDR_MAX];
+  uint32_t lastUsed;
+};
+
+struct Cslip {
+  CslipState rx[CSLIP_SLOTS];
+  CslipState tx[CSLIP_SLOTS];
+  uint8_t lastRx;
+  uint8_t lastTx;
+  uint32_t clock;
+  bool toss;
+  bool active;
+
+  void reset() {
+    memset(rx, 0, sizeof(rx));
+    memset(tx, 0, sizeof(tx));
+    lastRx = 0;
+    lastTx = 0xFF;
+    clock = 0;
+    toss = true;
+    active = false;
+  }
+
+  static uint8_t *encode(uint8_t *p, uint16_t n) {
+    if (n == 0 || n > 255) {
+      *p++ = 0;
+      *p++ = n >> 8;
+    }
+
+    *p++ = n;
+
+    return p;
+  }
+
+  static uint16_t decode(const uint8_t *&p) {
+    uint16_t n = *p++;
+
+    if (n == 0) {
+      n = get16(p);
+      p += 2;
+    }
+
+    return n;
+  }
+
+  static size_t headerLength(const uint8_t *packet) {
+    size_t ipLen = (packet[0] & 0x0F) * 4;
+    return ipLen + (packet[ipLen + 12] >> 4) * 4;
+  }
+
+  CslipState *txSlot(const uint8_t *packet, size_t ipLen) {
+    CslipState *lru = &tx[0];
+
+    for (uint8_t i = 0; i < CSLIP_SLOTS; i++) {
+      CslipState *cs = &tx[i];
+
+      if (cs->hlen &&
+          memcmp(cs->hdr + 12, packet + 12, 8) == 0 &&
+          memcmp(cs->hdr + ipLen, packet + ipLen, 4) == 0) {
+        return cs;
+      }
+
+      if (cs->lastUsed < lru->lastUsed) {
+        lru = cs;
+      }
+    }
+
+    lru->hlen = 0;
+    return lru;
+  }
+
+  // Compress the header of the IP packet in "packet" in place. Returns the
+  // length of what's left to send, which starts at "*frame".
+  size_t compress(uint8_t *packet, size_t length, uint8_t **frame) {
+    *frame = packet;
+
+    if (!active || length < 40 || packet[9] != IP_PROTO_TCP) {
+      return length;
+    }
+
+    size_t ipLen = (packet[0] & 0x0F) * 4;
+    size_t hlen = headerLength(packet);
+    uint8_t *tcp = packet + ipLen;
+
+    if (ipLen < 20 || hlen < ipLen + 20 || hlen > CSLIP_HDR_MAX || hlen > length) {
+      return length;
+    }
+
+    if ((get16(packet + 6) & 0x3FFF) ||
+        (tcp[13] & (TCP_SYN | TCP_FIN | TCP_RST | TCP_ACK)) != TCP_ACK) {
+      return length;
+    }
+
+    CslipState *cs = txSlot(packet, ipLen);
+    uint8_t slot = cs - tx;
+    uint8_t *old = cs->hdr;
+    uint8_t *otcp = old + ipLen;
+    uint8_t deltas[16];
+    uint8_t *p = deltas;
+    uint8_t changes = 0;
+
+    cs->lastUsed = ++clock;
+
+    // Anything other than the per-segment fields changing, options included,
+    // means the header has to go out whole
+    if (cs->hlen != hlen ||
+        memcmp(old, packet, 2) != 0 ||
+        memcmp(old + 6, packet + 6, 4) != 0 ||
+        memcmp(old + 20, packet + 20, ipLen - 20) != 0 ||
+        otcp[12] != tcp[12] ||
+        memcmp(otcp + 20, tcp + 20, hlen - ipLen - 20) != 0) {
+      return uncompressed(cs, slot, packet, length, hlen);
+    }
+
+    if (tcp[13] & TCP_URG) {
+      p = encode(p, get16(tcp + 18));
+      changes |= CSLIP_NEW_U;
+    } else if (get16(tcp + 18) != get16(otcp + 18)) {
+      return uncompressed(cs, slot, packet, length, hlen);
+    }
+
+    uint16_t deltaW = get16(tcp + 14) - get16(otcp + 14);
+    if (deltaW) {
+      p = encode(p, deltaW);
+      changes |= CSLIP_NEW_W;
+    }
+
+    uint32_t deltaA = get32(tcp + 8) - get32(otcp + 8);
+    if (deltaA) {
+      if (deltaA > 0xFFFF) return uncompressed(cs, slot, packet, length, hlen);
+      p = encode(p, deltaA);
+      changes |= CSLIP_NEW_A;
+    }
+
+    uint32_t deltaS = get32(tcp + 4) - get32(otcp + 4);
+    if (deltaS) {
+      if (deltaS > 0xFFFF) return uncompressed(cs, slot, packet, length, hlen);
+      p = encode(p, deltaS);
+      changes |= CSLIP_NEW_S;
+    }
+
+    uint16_t oldDataLen = get16(old + 2) - hlen;
+
+    switch (changes) {
+      case 0:
+        // Data after a pure ACK is fine, a repeat of the last segment is a
+        // retransmission and the RC2014 may have missed the original
+        if (get16(packet + 2) != get16(old + 2) && oldDataLen == 0) break;
+        return uncompressed(cs, slot, packet, length, hlen);
+
+      case CSLIP_SPECIAL_I:
+      case CSLIP_SPECIAL_D:
+        return uncompressed(cs, slot, packet, length, hlen);
+
+      case CSLIP_NEW_S | CSLIP_NEW_A:
+        if (deltaS == deltaA && deltaS == oldDataLen) {
+          changes = CSLIP_SPECIAL_I;
+          p = deltas;
+        }
+        break;
+
+      case CSLIP_NEW_S:
+        if (deltaS == oldDataLen) {
+          changes = CSLIP_SPECIAL_D;
+          p = deltas;
+        }
+        break;
+    }
+
+    uint16_t deltaI = get16(packet + 4) - get16(old + 4);
+    if (deltaI != 1) {
+      p = encode(p, deltaI);
+      changes |= CSLIP_NEW_I;
+    }
+
+    if (tcp[13] & TCP_PSH) {
+      changes |= CSLIP_PUSH;
+    }
+
+    uint8_t csum[2] = { tcp[16], tcp[17] };
+    memcpy(cs->hdr, packet, hlen);
+
+    // Build the compressed header backwards from the start of the payload
+    size_t n = p - deltas;
+    uint8_t *out = packet + hlen - n;
+    memcpy(out, deltas, n);
+
+    out -= 2;
+    memcpy(out, csum, 2);
+
+    if (slot != lastTx) {
+      *--out = slot;
+      changes |= CSLIP_NEW_C;
+      lastTx = slot;
+    }
+
+    *--out = changes | CSLIP_TYPE_COMPRESSED_TCP;
+
+    *frame = out;
+    return length - (out - packet);
+  }
+
+  size_t uncompressed(CslipState *cs, uint8_t slot, uint8_t *packet, size_t length, size_t hlen) {
+    memcpy(cs->hdr, packet, hlen);
+    cs->hlen = hlen;
+    lastTx = slot;
+
+    packet[9] = slot;
+    packet[0] |= CSLIP_TYPE_UNCOMPRESSED_TCP;
+
+    return length;
+  }
+
+  // Turn a received frame back into an IP packet in "out". Returns its
+  // length, or 0 if the frame has to be dropped.
+  size_t uncompress(uint8_t *frame, size_t length, uint8_t *out) {
+    uint8_t type = frame[0];
+
+    if (type & CSLIP_TYPE_COMPRESSED_TCP) {
+      if (CSLIP_ENABLED) active = true;
+      return uncompressCompressed(frame, length, out);
+    }
+
+    if (type >= CSLIP_TYPE_UNCOMPRESSED_TCP) {
+      if (CSLIP_ENABLED) active = true;
+
+      uint8_t slot = frame[9];
+
+      if (slot >= CSLIP_SLOTS || length < 40) {
+        toss = true;
+        return 0;
+      }
+
+      frame[0] &= 0x4F;
+      frame[9] = IP_PROTO_TCP;
+
+      size_t hlen = headerLength(frame);
+
+      if (hlen < 40 || hlen > CSLIP_HDR_MAX || hlen > length) {
+        toss = true;
+        return 0;
+      }
+
+      rx[slot].hlen = hlen;
+      memcpy(rx[slot].hdr, frame, hlen);
+
+      lastRx = slot;
+      toss = false;
+    }
+
+    memcpy(out, frame, length);
+    return length;
+  }
+
+  size_t uncompressCompressed(const uint8_t *frame, size_t length, uint8_t *out) {
+    const uint8_t *p = frame;
+    uint8_t changes = *p++;
+
+    if (changes & CSLIP_NEW_C) {
+      if (*p >= CSLIP_SLOTS) {
+        toss = true;
+        return 0;
+      }
+
+      lastRx = *p++;
+      toss = false;
+    } else if (toss) {
+      return 0;
+    }
+
+    CslipState *cs = &rx[lastRx];
+
+    if (cs->hlen == 0) {
+      toss = true;
+      return 0;
+    }
+
+    uint8_t *ip = cs->hdr;
+    size_t ipLen = (ip[0] & 0x0F) * 4;
+    uint8_t *tcp = ip + ipLen;
+
+    tcp[16] = *p++;
+    tcp[17] = *p++;
+
+    if (changes & CSLIP_PUSH) {
+      tcp[13] |= TCP_PSH;
+    } else {
+      tcp[13] &= ~TCP_PSH;
+    }
+
+    uint16_t oldDataLen = get16(ip + 2) - cs->hlen;
+
+    switch (changes & CSLIP_SPECIALS_MASK) {
+      case CSLIP_SPECIAL_I:
+        put32(tcp + 8, get32(tcp + 8) + oldDataLen);
+        put32(tcp + 4, get32(tcp + 4) + oldDataLen);
+        break;
+
+      case CSLIP_SPECIAL_D:
+        put32(tcp + 4, get32(tcp + 4) + oldDataLen);
+        break;
+
+      default:
+        if (changes & CSLIP_NEW_U) {
+          tcp[13] |= TCP_URG;
+          put16(tcp + 18, decode(p));
+        } else {
+          tcp[13] &= ~TCP_URG;
+        }
+
+        if (changes & CSLIP_NEW_W) put16(tcp + 14, get16(tcp + 14) + decode(p));
+        if (changes & CSLIP_NEW_A) put32(tcp + 8, get32(tcp + 8) + decode(p));
+        if (changes & CSLIP_NEW_S) put32(tcp + 4, get32(tcp + 4) + decode(p));
+        break;
+    }
+
+    if (changes & CSLIP_NEW_I) {
+      put16(ip + 4, get16(ip + 4) + decode(p));
+    } else {
+      put16(ip + 4, get16(ip + 4) + 1);
+    }
+
+    size_t n = p - frame;
+
+    if (n > length || length - n + cs->hlen > SLIP_MTU) {
+      toss = true;
+      return 0;
+    }
+
+    size_t dataLen = length - n;
+
+    put16(ip + 2, dataLen + cs->hlen);
+    put16(ip + 10, 0);
+    uint16_t sum = inet_chksum(ip, ipLen);
+    memcpy(ip + 10, &sum, 2);
+
+    memcpy(out, cs->hdr, cs->hlen);
+    memcpy(out + cs->hlen, p, dataLen);
+
+    return cs->hlen + dataLen;
+  }
+};
+
 struct netif slipNetif;
 SlipDecoder slipDecoder;
+Cslip cslip;
+SlipFlow slipFlow;
 bool slipInitialized = false;
 bool expectingResponse = false;
 
@@ -118,41 +526,91 @@ uint8_t txQueueTail = 0;
 
 const uint8_t TX_BURST_SIZE = 40;
 
+void slipRxPacket(uint8_t* frame, size_t frameLength);
+
 err_t slipInput(struct pbuf *p, struct netif *inp) {
   return ip_input(p, inp);
 }
 
+// Feed whatever the RC2014 has sent so far to the decoder without waiting
+void slipRxPoll() {
+  while (Serial.available()) {
+    uint8_t status = slipDecoder.decode(Serial.read());
+
+    if (status == SLIP_DECODE_DONE) {
+      slipRxPacket(slipDecoder.buffer, slipDecoder.length);
+      slipDecoder.reset();
+    } else if (status == SLIP_DECODE_RST) {
+      slipDecoder.reset();
+      cslip.toss = true;
+    }
+  }
+}
+
+void slipPortWrite(uint8_t b) {
+  Serial.write(b);
+}
+
+size_t slipPortQueued() {
+  return SERIAL_TX_FIFO_SIZE - Serial.availableForWrite();
+}
+
+bool slipPortClearToSend() {
+  return digitalRead(SLIP_CTS_PIN) == LOW;
+}
+
+void slipPortPoll() {
+  slipRxPoll();
+  yield();
+}
+
+uint32_t slipPortMillis() {
+  return millis();
+}
+
+const SlipFlowPort slipPort = {
+  slipPortWrite,
+  slipPortQueued,
+  slipPortClearToSend,
+  slipPortPoll,
+  slipPortMillis
+};
+
 void slipTxFrame(struct pbuf *p) {
   digitalWrite(LED_ACTIVITY, HIGH);
 
   uint8_t buffer[SLIP_MTU];
+  uint8_t *frame;
   pbuf_copy_partial(p, buffer, p->tot_len, 0);
 
+  size_t length = cslip.compress(buffer, p->tot_len, &frame);
+
   // Send SLIP_END to start frame
-  Serial.write(SLIP_END);
+  slipFlow.write(SLIP_END);
 
-  for (size_t i = 0; i < p->tot_len; i++) {
-    uint8_t b = buffer[i];
+  for (size_t i = 0; i < length; i++) {
+    uint8_t b = frame[i];
     if (b == SLIP_END) {
-      Serial.write(SLIP_ESC);
-      Serial.write(SLIP_ESC_END);
+      slipFlow.write(SLIP_ESC);
+      slipFlow.write(SLIP_ESC_END);
     } else if (b == SLIP_ESC) {
-      Serial.write(SLIP_ESC);
-      Serial.write(SLIP_ESC_ESC);
+      slipFlow.write(SLIP_ESC);
+      slipFlow.write(SLIP_ESC_ESC);
     } else {
-      Serial.write(b);
+      slipFlow.write(b);
     }
 
-    // Delay to prevent overwhelming the RC2014's slow character-by-character reads.
-    // RC2014 C/PM has a 60-byte buffer so we can burst the first 40 bytes
-    // which is enough to cover SYN, SYN-ACK, ACK, FIN and RST packets.
-    if (i > TX_BURST_SIZE && i % 2 == 0) {
+    // Without CTS or credit from the RC2014, delay to avoid overwhelming
+    // slow character-by-character reads. RC2014 C/PM has a 60-byte buffer so
+    // we can burst the first 40 bytes which is enough to cover SYN, SYN-ACK,
+    // ACK, FIN and RST packets.
+    if (slipFlow.paced() && i > TX_BURST_SIZE && i % 2 == 0) {
       delay(1);
     }
   }
 
   // Add SLIP_END to end frame
-  Serial.write(SLIP_END);
+  slipFlow.write(SLIP_END);
   Serial.flush();
 
   digitalWrite(LED_ACTIVITY, LOW);
@@ -192,7 +650,9 @@ void slipTx() {
   slipTxFrame(p);
   pbuf_free(p);
 
-  expectingResponse = true;
+  // Flow control already stops the gateway overrunning the RC2014, so
+  // there's no need to wait for it to answer each frame
+  expectingResponse = slipFlow.paced();
 }
 
 err_t slipOutput(struct netif *netif, struct pbuf *p, const ip4_addr_t *ipaddr) {
@@ -203,16 +663,34 @@ err_t slipOutput(struct netif *netif, struct pbuf *p, const ip4_addr_t *ipaddr)
   if (txQueueEnqueue(p)) {
     return ERR_OK;
   } else {
-    // Queue full - connection will fail anyway due to RC2014's strict sequence checking
-    // Tell lwIP to abort the connection immediately rather than retry
-    return ERR_ABRT;
+    // Queue full - drop it. The RC2014 holds on to whatever arrives after
+    // the gap and sends duplicate ACKs, so the sender fills it in again.
+    return ERR_MEM;
   }
 }
 
 const uint32_t RX_TIMEOUT_MS = 250;
 const uint32_t RX_EMPTY_TIMEOUT_MS = 5;
 
-void slipRxPacket(uint8_t* buffer, size_t length) {
+void slipRxPacket(uint8_t* frame, size_t frameLength) {
+  uint8_t buffer[SLIP_MTU];
+
+  if (frameLength == 0 || frameLength > SLIP_MTU) return;
+
+  if (frameLength == 4 && frame[0] == SLIP_CREDIT) {
+    // A program that has just started may be built without CSLIP, and has
+    // no slots either way, so compression waits until it sends a
+    // compressed frame of its own
+    if (slipFlow.credit.update(get16(frame + 1), frame[3])) {
+      cslip.reset();
+    }
+
+    expectingResponse = false;
+    return;
+  }
+
+  size_t length = cslip.uncompress(frame, frameLength, buffer);
+
   if (length < 20 || length > SLIP_MTU) return;
 
   uint8_t version = (buffer[0] >> 4) & 0x0F;
@@ -252,6 +730,7 @@ void slipRx() {
         return;
       } else if (status == SLIP_DECODE_RST) {
         slipDecoder.reset();
+        cslip.toss = true;
         digitalWrite(LED_ACTIVITY, LOW);
         return;
       }
@@ -263,6 +742,7 @@ void slipRx() {
         return;
       } else if (elapsed > RX_TIMEOUT_MS) {
         digitalWrite(LED_ACTIVITY, LOW);
+        if (slipDecoder.length > 0) cslip.toss = true;
         slipDecoder.reset();
         return;
       } else {
@@ -351,6 +831,10 @@ void setupNAT() {
 void setup() {
   pinMode(LED_WIFI, OUTPUT);
   pinMode(LED_ACTIVITY, OUTPUT);
+
+  if (SLIP_CTS_PIN >= 0) {
+    pinMode(SLIP_CTS_PIN, INPUT_PULLUP);
+  }
   digitalWrite(LED_WIFI, LOW);
   digitalWrite(LED_ACTIVITY, HIGH);
 
@@ -376,6 +860,8 @@ void setup() {
   }
 
   slipDecoder.reset();
+  cslip.reset();
+  slipFlow.begin(&slipPort, SLIP_CTS_PIN >= 0);
 }
 
 void loop() {
@@ -0,0 +1,143 @@
+/*
+ * Flow control for frames going from the gateway to the RC2014.
+ *
+ * Nothing in here touches the Arduino core. The UART is reached through a
+ * SlipFlowPort, so the same logic can be driven on a Linux host against a
+ * pseudo-terminal with the port functions standing in for the hardware.
+ */
+
+#ifndef SLIP_FLOW_H
+#define SLIP_FLOW_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+const uint32_t SLIP_FLOW_TIMEOUT_MS = 1000;
+
+// Bytes allowed in the UART FIFO while honouring CTS. Anything already in the
+// FIFO goes out regardless, so this is how far the gateway can overrun once
+// the RC2014 drops RTS.
+const size_t SLIP_FLOW_CTS_QUEUE = 2;
+
+struct SlipFlowPort {
+  void (*write)(uint8_t b);
+  size_t (*queued)();     // bytes written but still waiting in the FIFO
+  bool (*clearToSend)();  // the RC2014's RTS line, asserted
+  void (*poll)();         // handle anything received while waiting
+  uint32_t (*millis)();
+};
+
+// Credit-based flow control. The RC2014 reports how many bytes it has taken
+// off its serial port and how many more it can take, and the gateway sends
+// at full line rate while its own count stays inside that window.
+struct SlipCredit {
+  bool active;
+  bool synced; // Heard from the RC2014 since the gateway started
+  uint16_t sent;
+  uint16_t consumed;
+  uint8_t window;
+
+  void reset() {
+    active = false;
+    synced = false;
+    sent = 0;
+    consumed = 0;
+    window = 0;
+  }
+
+  // Returns true for the first credit from an RC2014 that has just started,
+  // or restarted, so anything else kept about it can be forgotten too
+  bool update(uint16_t rxConsumed, uint8_t rxWindow) {
+    uint16_t inFlight = sent - rxConsumed;
+
+    // The first credit, or one from an RC2014 that has restarted, brings
+    // the two counts back into step. A restart shows up as its count going
+    // backwards, or as one far behind what was sent.
+    bool started = !synced || (int16_t)(rxConsumed - consumed) < 0 || inFlight > 0x0FFF;
+
+    // Bytes sent while pacing are counted too, so after a timeout the count
+    // only has to be given up on if more than a window's worth never arrived
+    if (started || (!active && inFlight > rxWindow)) {
+      sent = rxConsumed;
+    }
+
+    synced = true;
+    active = true;
+    consumed = rxConsumed;
+    window = rxWindow;
+
+    return started;
+  }
+
+  uint16_t available() {
+    uint16_t inFlight = sent - consumed;
+    return inFlight < window ? window - inFlight : 0;
+  }
+};
+
+struct SlipFlow {
+  const SlipFlowPort *port;
+  SlipCredit credit;
+  bool cts;
+
+  void begin(const SlipFlowPort *p, bool useCts) {
+    port = p;
+    cts = useCts;
+    credit.reset();
+  }
+
+  // True when neither CTS nor credit is in use and the caller has to pace
+  // itself the old way
+  bool paced() {
+    return !cts && !credit.active;
+  }
+
+  // Wait for the RC2014 to raise RTS. It drops it while it's busy with a
+  // frame, so a line that stays down for long means nothing is listening.
+  void waitForCts() {
+    uint32_t start = port->millis();
+
+    while (!port->clearToSend() || port->queued() >= SLIP_FLOW_CTS_QUEUE) {
+      if (port->millis() - start > SLIP_FLOW_TIMEOUT_MS) {
+        return;
+      }
+
+      port->poll();
+    }
+  }
+
+  // Credit that doesn't arrive means the RC2014 is busy with something long,
+  // like reading through its files, or has lost count. Its ring may still be
+  // full either way, so rather than granting a fresh window the gateway goes
+  // back to pacing itself until the next credit frame turns credit back on.
+  // Returns false if that happened.
+  bool waitForCredit() {
+    uint32_t start = port->millis();
+
+    while (credit.available() == 0) {
+      if (port->millis() - start > SLIP_FLOW_TIMEOUT_MS) {
+        credit.active = false;
+        return false;
+      }
+
+      port->poll();
+    }
+
+    return true;
+  }
+
+  void write(uint8_t b) {
+    if (cts) {
+      waitForCts();
+    }
+
+    if (credit.active) {
+      waitForCredit();
+    }
+
+    credit.sent++;
+    port->write(b);
+  }
+};
+
+#endif
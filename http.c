@@ -1,10 +1,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include "http.h"
+#include "slip.h"
+#include "clock.h"
+#include "ip.h"
 #include "tcp.h"
+#include "http.h"
 
 struct http_client *http_client_table;
+static uint16_t http_poll_clock;
+
+struct http_file http_index[HTTP_INDEX_MAX];
+uint8_t http_index_len;
+
+struct http_cache_entry http_cache[HTTP_CACHE_ENTRIES];
+static uint16_t http_cache_size; // Bytes held across all entries
+static uint16_t http_cache_clock; // Counts requests, to find the least recently used entry
+uint16_t http_cache_hits;
+uint16_t http_cache_misses;
 
 const char * const mime_types[] = {
   "htm", "text/html",
@@ -23,24 +36,33 @@ const char * const mime_types[] = {
 
 const char * const text_types[] = { "htm", "txt", "css", "js", "jsn", "xml", "svg", NULL };
 
-uint8_t *http_tx_buffer;
-
 const char *http_system_response_fmt = "\
-HTTP/1.0 %u %s\r\n\
+HTTP/1.1 %u %s\r\n\
 Content-Type: text/html\r\n\
 Content-Length: %u\r\n\
+Connection: %s\r\n\
 \r\n\
 %u %s\r\n";
 
+// The ETag and Connection lines are written separately, so the rest can be
+// cached
 const char *http_response_fmt = "\
-HTTP/1.0 200 OK\r\n\
+HTTP/1.1 200 OK\r\n\
 Content-Type: %s\r\n\
-Content-Length: %lu\r\n\
+Content-Length: %lu\r\n";
+
+const char *http_not_modified = "HTTP/1.1 304 Not Modified\r\n";
+
+const char *http_etag_fmt = "ETag: \"%lx-%lx\"\r\n";
+
+const char *http_connection_fmt = "\
+Connection: %s\r\n\
 \r\n";
 
 void http_init(void) {
   http_client_table = calloc(HTTP_MAX_CLIENTS, sizeof(struct http_client));
-  http_tx_buffer = malloc(TCP_PACKET_LEN);
+
+  http_index_build();
 }
 
 struct http_client *http_get_client(struct tcp_sock *s) {
@@ -62,25 +84,60 @@ void http_log(struct http_client *c, uint16_t code) {
 }
 
 void http_system_response(struct http_client *c, uint16_t code, char *message) {
-  sprintf((char *)http_tx_buffer, http_system_response_fmt, code, message, 4 + strlen(message) + 2, code, message);
+  c->code = code;
+  c->message = message;
 
-  c->tx_cur = strlen((char *)http_tx_buffer);
+  // After anything but a missing file we can't be sure where the next
+  // request starts
+  if (code != 404) {
+    c->keep_alive = 0;
+  }
 
   http_log(c, code);
 
   c->state = HTTP_TX_HDR;
 }
 
-char *http_content_type(struct http_client *c) {
+// Write the response header straight into the outgoing segment, returning its length
+uint16_t http_header(struct http_client *c, char *buffer) {
+  char *connection = c->keep_alive ? "keep-alive" : "close";
+  uint16_t len;
+
+  if (c->code == 304) {
+    strcpy(buffer, http_not_modified);
+    len = strlen(buffer);
+  } else if (c->code != 200) {
+    sprintf(buffer, http_system_response_fmt, c->code, c->message, 4 + strlen(c->message) + 2, connection, c->code, c->message);
+    return strlen(buffer);
+  } else if (c->cache) {
+    len = c->cache->hdr_len;
+    memcpy(buffer, c->cache->data, len);
+  } else {
+    sprintf(buffer, http_response_fmt, c->type, c->tx_len);
+    len = strlen(buffer);
+  }
+
+  // Only once the file's hash has been worked out
+  if (c->etag) {
+    sprintf(&buffer[len], http_etag_fmt, c->tx_len, c->hash);
+    len += strlen(&buffer[len]);
+  }
+
+  sprintf(&buffer[len], http_connection_fmt, connection);
+
+  return len + strlen(&buffer[len]);
+}
+
+char *http_content_type(char *name) {
   char ext[4];
   uint8_t i;
-  uint16_t len = strlen(c->req_file);
+  uint16_t len = strlen(name);
 
   if (len < 4) {
     return "application/octet-stream";
   }
 
-  strncpy(ext, &c->req_file[len - 3], 4);
+  strncpy(ext, &name[len - 3], 4);
 
   for (i = 0; mime_types[i]; i += 2) {
     if (strcasecmp(ext, mime_types[i]) == 0) {
@@ -91,16 +148,16 @@ char *http_content_type(struct http_client *c) {
   return "application/octet-stream";
 }
 
-uint8_t http_file_mode(struct http_client *c) {
+uint8_t http_file_mode(char *name) {
   char ext[4];
   uint8_t i;
-  uint16_t len = strlen(c->req_file);
+  uint16_t len = strlen(name);
 
   if (len < 4) {
     return HTTP_FILE_MODE_BINARY;
   }
 
-  strncpy(ext, &c->req_file[len - 3], 4);
+  strncpy(ext, &name[len - 3], 4);
 
   for (i = 0; text_types[i]; i++) {
     if (strcasecmp(ext, text_types[i]) == 0) {
@@ -111,15 +168,15 @@ uint8_t http_file_mode(struct http_client *c) {
   return HTTP_FILE_MODE_BINARY;
 }
 
-int16_t http_file_open(struct http_client *c) {
-  if (c->file_mode == HTTP_FILE_MODE_TEXT) {
-    return open(&c->req_file[1], O_RDONLY, _IOTEXT);
+int16_t http_file_open(char *name, uint8_t file_mode) {
+  if (file_mode == HTTP_FILE_MODE_TEXT) {
+    return open(name, O_RDONLY, _IOTEXT);
   } else {
-    return open(&c->req_file[1], O_RDONLY, 0);
+    return open(name, O_RDONLY, 0);
   }
 }
 
-uint32_t http_content_length(struct http_client *c, int16_t fd) {
+uint32_t http_content_length(int16_t fd, uint8_t file_mode) {
   uint32_t pos;
 
   _fcb[fd].mode = 0;
@@ -127,7 +184,7 @@ uint32_t http_content_length(struct http_client *c, int16_t fd) {
   lseek(fd, 0, SEEK_END);
   pos = fdtell(fd);
 
-  if (c->file_mode == HTTP_FILE_MODE_TEXT) {
+  if (file_mode == HTTP_FILE_MODE_TEXT) {
     if (pos >= SECSIZE) {
       lseek(fd, pos - SECSIZE, SEEK_SET);
     }
@@ -141,111 +198,606 @@ uint32_t http_content_length(struct http_client *c, int16_t fd) {
   return pos;
 }
 
-void http_response(struct http_client *c) {
-  c->file_mode = http_file_mode(c);
+struct http_cache_entry *http_cache_find(char *file) {
+  uint8_t i;
 
-  c->fd = http_file_open(c);
+  for (i = 0; i < HTTP_CACHE_ENTRIES; i++) {
+    if (http_cache[i].data && strcasecmp(http_cache[i].file, file) == 0) {
+      return &http_cache[i];
+    }
+  }
 
-  if (c->fd >= 0) {
-    c->tx_len = http_content_length(c, c->fd);
+  return NULL;
+}
+
+// Find a free entry with "len" bytes of the budget to go with it, dropping
+// the least recently used responses to make room. Entries still being sent
+// from are left alone, so this returns NULL if they're in the way.
+struct http_cache_entry *http_cache_alloc(uint16_t len) {
+  struct http_cache_entry *e;
+  struct http_cache_entry *slot;
+  struct http_cache_entry *lru;
+  uint8_t i;
 
-    sprintf((char *)http_tx_buffer, http_response_fmt, http_content_type(c), c->tx_len);
+  while (1) {
+    slot = NULL;
+    lru = NULL;
 
-    http_log(c, 200);
+    for (i = 0; i < HTTP_CACHE_ENTRIES; i++) {
+      e = &http_cache[i];
 
-    // For HEAD requests, close file since we won't send the body
-    if (strncmp(c->req_method, "HEAD", 4) == 0) {
-      close(c->fd);
-      c->fd = -1;
+      if (!e->data) {
+        if (!slot) {
+          slot = e;
+        }
+      } else if (!e->users && (!lru || (int16_t)(e->used - lru->used) < 0)) {
+        lru = e;
+      }
     }
 
-    c->state = HTTP_TX_HDR;
-  } else {
-    http_system_response(c, 404, "Not Found");
+    if (slot && http_cache_size + len <= HTTP_CACHE_BUDGET) {
+      return slot;
+    }
+
+    if (!lru) {
+      return NULL;
+    }
+
+    http_cache_drop(lru);
   }
 }
 
-void http_parse_request(struct http_client *c) {
-  char *req_method;
-  char *req_file;
+// Read the whole of the file open on "c" into the cache along with the
+// start of its header, summing it for its hash if that isn't known yet.
+// Returns NULL if it's too big or won't fit.
+struct http_cache_entry *http_cache_fill(struct http_client *c) {
+  struct http_cache_entry *e;
+  char hdr[HTTP_CACHE_HDR_LEN];
+  uint16_t hdr_len;
+  uint16_t len;
+  uint16_t got;
+  uint16_t n;
+
+  if (c->tx_len > HTTP_CACHE_FILE_MAX) {
+    return NULL;
+  }
 
-  if (c->rx_cur < 9) {
-    return;
+  len = c->tx_len;
+
+  sprintf(hdr, http_response_fmt, c->type, c->tx_len);
+  hdr_len = strlen(hdr);
+
+  e = http_cache_alloc(hdr_len + len);
+
+  if (!e || !(e->data = malloc(hdr_len + len))) {
+    return NULL;
   }
 
-  if (strncmp(&c->rx_buff[c->rx_cur - 4], "\r\n\r\n", 4) != 0) {
-    return;
+  memcpy(e->data, hdr, hdr_len);
+
+  lseek(c->fd, 0, SEEK_SET);
+
+  for (got = 0; got < len; got += n) {
+    n = read(c->fd, &e->data[hdr_len + got], len - got);
+
+    // Short or failed, so leave it to be read from disk
+    if (n == 0 || n > len - got) {
+      free(e->data);
+      e->data = NULL;
+      return NULL;
+    }
   }
 
-  req_method = strtok(c->rx_buff, " ");
-  if (!req_method) {
-    http_system_response(c, 400, "Bad Request");
-    return;
+  if (c->hashing) {
+    http_hash_add(c, &e->data[hdr_len], len);
   }
 
-  if (strlen(req_method) > 7) {
-    http_system_response(c, 400, "Bad Request");
+  strcpy(e->file, c->req_file);
+  e->users = 0;
+  e->hdr_len = hdr_len;
+  e->len = len;
+
+  http_cache_size += hdr_len + len;
+
+  return e;
+}
+
+void http_cache_drop(struct http_cache_entry *e) {
+  http_cache_size -= e->hdr_len + e->len;
+
+  free(e->data);
+  e->data = NULL;
+}
+
+// Forget every cached response. One still being sent from can't be freed
+// yet, so it's unnamed, and goes once the last client is finished with it.
+void http_cache_flush(void) {
+  uint8_t i;
+
+  for (i = 0; i < HTTP_CACHE_ENTRIES; i++) {
+    if (!http_cache[i].data) {
+      continue;
+    }
+
+    if (http_cache[i].users) {
+      http_cache[i].file[0] = '\0';
+    } else {
+      http_cache_drop(&http_cache[i]);
+    }
+  }
+}
+
+void http_cache_release(struct http_client *c) {
+  if (c->cache) {
+    if (--c->cache->users == 0 && !c->cache->file[0]) {
+      http_cache_drop(c->cache);
+    }
+
+    c->cache = NULL;
+  }
+}
+
+struct http_file *http_index_find(char *name) {
+  uint8_t i;
+
+  for (i = 0; i < http_index_len; i++) {
+    if (strcasecmp(http_index[i].name, name) == 0) {
+      return &http_index[i];
+    }
+  }
+
+  return NULL;
+}
+
+// Turn a directory entry's space padded name and type into "NAME.EXT". The
+// top bits carry the file's attributes.
+void http_index_name(char *name, uint8_t *entry) {
+  uint8_t i;
+
+  for (i = 1; i <= 8 && (entry[i] & 0x7F) != ' '; i++) {
+    *name++ = entry[i] & 0x7F;
+  }
+
+  if ((entry[9] & 0x7F) != ' ') {
+    *name++ = '.';
+
+    for (i = 9; i <= 11 && (entry[i] & 0x7F) != ' '; i++) {
+      *name++ = entry[i] & 0x7F;
+    }
+  }
+
+  *name = '\0';
+}
+
+// Add the next "len" bytes of the body to Fletcher's checksum of it, which
+// unlike a plain sum changes when bytes are moved around. Once the whole
+// body has been summed the hash is kept in the index, so later responses
+// for the file carry an ETag.
+void http_hash_add(struct http_client *c, uint8_t *data, uint16_t len) {
+  struct http_file *f;
+  uint16_t i;
+
+  for (i = 0; i < len; i++) {
+    c->hash_sum1 += data[i];
+    c->hash_sum2 += c->hash_sum1;
+  }
+
+  c->hash_pos += len;
+
+  if (c->hash_pos < c->tx_len) {
     return;
   }
 
-  req_file = strtok(NULL, " ");
-  if (!req_file) {
-    http_system_response(c, 400, "Bad Request");
+  c->hashing = 0;
+
+  f = http_index_find(&c->req_file[1]);
+
+  if (f && !f->hashed) {
+    f->hash = ((uint32_t)c->hash_sum2 << 16) | c->hash_sum1;
+    f->hashed = 1;
+  }
+}
+
+// List the files on the current drive and user area, with the length each
+// is served at and its type, so requests don't have to open them to find
+// out. Hashes are left to be worked out as each file is first sent. Cached
+// responses are thrown away too, since the files behind them may have
+// changed, and so are sums of files part way through being sent. A file
+// that can't be opened now, because every handle is busy sending, is
+// sized when it's first asked for instead.
+void http_index_build(void) {
+  uint8_t fcb[36];
+  uint8_t dma[SECSIZE];
+  struct http_file *f;
+  uint8_t found;
+  int16_t fd;
+  uint8_t i;
+
+  http_cache_flush();
+
+  for (i = 0; i < HTTP_MAX_CLIENTS; i++) {
+    http_client_table[i].hashing = 0;
+  }
+
+  // Match every name in the first extent of each file
+  memset(fcb, 0, sizeof(fcb));
+  memset(&fcb[1], '?', 11);
+
+  bdos(CPM_SDMA, (int)dma);
+
+  http_index_len = 0;
+
+  for (found = bdos(CPM_FFST, (int)fcb); found != 0xFF; found = bdos(CPM_FNXT, 0)) {
+    if (http_index_len == HTTP_INDEX_MAX) {
+      break;
+    }
+
+    http_index_name(http_index[http_index_len++].name, &dma[(found & 3) * 32]);
+  }
+
+  // Searches can't be mixed with other file calls, so the lengths are
+  // found once the directory has been read
+  for (i = 0; i < http_index_len; i++) {
+    f = &http_index[i];
+
+    f->mode = http_file_mode(f->name);
+    f->type = http_content_type(f->name);
+
+    f->hashed = 0;
+    f->sized = 0;
+
+    fd = http_file_open(f->name, f->mode);
+
+    if (fd >= 0) {
+      f->len = http_content_length(fd, f->mode);
+      f->sized = 1;
+
+      close(fd);
+    }
+  }
+
+  // Back to the default buffer, as this one is about to go
+  bdos(CPM_SDMA, 0x80);
+
+  printf("Indexed %u files\n", http_index_len);
+}
+
+void http_response(struct http_client *c) {
+  uint8_t head = strncmp(c->req_method, "HEAD", 4) == 0;
+  struct http_file *f = http_index_find(&c->req_file[1]);
+  struct http_cache_entry *e = NULL;
+  int16_t fd;
+
+  if (!f) {
+    http_system_response(c, 404, "Not Found");
     return;
   }
 
-  if (strlen(req_file) >= 14) {
-    http_system_response(c, 414, "URI Too Long");
+  if (!f->sized) {
+    fd = http_file_open(f->name, f->mode);
+
+    if (fd < 0) {
+      http_system_response(c, 404, "Not Found");
+      return;
+    }
+
+    f->len = http_content_length(fd, f->mode);
+    f->sized = 1;
+
+    close(fd);
+  }
+
+  c->file_mode = f->mode;
+  c->type = f->type;
+  c->tx_len = f->len;
+  c->etag = f->hashed;
+  c->hash = f->hash;
+
+  // The client already has this version, so only the header goes out
+  if (c->req_etag == HTTP_ETAG_ANY || (c->req_etag == HTTP_ETAG_TAG && f->hashed && c->req_etag_len == f->len && c->req_etag_hash == f->hash)) {
+    c->code = 304;
+
+    http_log(c, 304);
+
+    c->state = HTTP_TX_HDR;
     return;
   }
 
-  if (req_file[0] != '/') {
-    http_system_response(c, 400, "Bad Request");
+  // The first time the file is sent it's summed on the way
+  c->hashing = !head && !f->hashed;
+  c->hash_pos = 0;
+  c->hash_sum1 = 0;
+  c->hash_sum2 = 0;
+
+  // HEAD requests are answered from the index alone
+  if (!head) {
+    e = http_cache_find(c->req_file);
+
+    if (e) {
+      http_cache_hits++;
+    } else {
+      http_cache_misses++;
+
+      c->fd = http_file_open(f->name, f->mode);
+
+      if (c->fd < 0) {
+        http_system_response(c, 404, "Not Found");
+        return;
+      }
+
+      // Once the file is cached there's nothing more to read from it
+      e = http_cache_fill(c);
+
+      if (e) {
+        close(c->fd);
+        c->fd = -1;
+
+        // Filling it worked out the hash, in time for this header
+        c->etag = f->hashed;
+        c->hash = f->hash;
+      }
+    }
+  }
+
+  if (e) {
+    e->used = ++http_cache_clock;
+    c->cache = e;
+    e->users++;
+  }
+
+  c->code = 200;
+
+  http_log(c, 200);
+
+  c->state = HTTP_TX_HDR;
+}
+
+// The request has been read. Answer it, or whatever was wrong with it.
+void http_request(struct http_client *c) {
+  if (c->req_error == 414) {
+    http_system_response(c, 414, "URI Too Long");
     return;
   }
 
-  if (strchr(req_file, ':')) {
+  if (c->req_error || !c->req_method[0] || c->req_file[0] != '/' || strchr(c->req_file, ':')) {
     http_system_response(c, 400, "Bad Request");
     return;
   }
 
-  strcpy(c->req_method, req_method);
+  if (++c->requests >= HTTP_MAX_REQUESTS) {
+    c->keep_alive = 0;
+  }
 
-  if (strlen(req_file) == 1) {
+  if (strlen(c->req_file) == 1) {
     strcpy(c->req_file, "/INDEX.HTM");
-  } else {
-    strcpy(c->req_file, req_file);
   }
 
-  if (strncmp(c->req_method, "GET", 3) == 0 || strncmp(c->req_method, "HEAD", 4) == 0) {
+  if (strcmp(c->req_method, "GET") == 0 || strcmp(c->req_method, "HEAD") == 0) {
     http_response(c);
   } else {
+    // There may be a body we don't know how to skip
+    c->keep_alive = 0;
     http_system_response(c, 404, "Not Found");
   }
 }
 
-void http_open(struct tcp_sock *s) {
-  struct http_client *c = &http_client_table[0];
-  struct http_client *cc;
-  uint8_t i;
+// Get ready to read a new request
+void http_rx_reset(struct http_client *c) {
+  c->parse = HTTP_PARSE_METHOD;
+  c->parse_len = 0;
+  c->req_len = 0;
+  c->req_error = 0;
+  c->req_etag = HTTP_ETAG_NONE;
+  c->req_method[0] = '\0';
+  c->req_file[0] = '\0';
+  c->keep_alive = 0;
+}
 
-  for (i = 0; i < HTTP_MAX_CLIENTS; i++) {
-    cc = &http_client_table[i];
-    if (!cc->s) {
-      c = cc;
+// Read a request a byte at a time as it arrives. The method and path are
+// kept, along with whether the client wants the connection kept open, and
+// every other header is skipped over. Returns how much of "data" was used,
+// which stops short of "len" once the request is complete and answered.
+//
+// Header names and values are compared with 0x20 ORed in, which lower cases
+// letters and leaves ':' and '-' as they are.
+uint16_t http_rx_parse(struct http_client *c, uint8_t *data, uint16_t len) {
+  uint16_t i;
+  char ch;
+
+  for (i = 0; i < len && c->state == HTTP_RX_REQ; i++) {
+    ch = data[i];
+
+    if (++c->req_len > HTTP_REQ_MAX) {
+      http_system_response(c, 431, "Request Header Fields Too Large");
       break;
     }
 
-    if (cc->s->ticks > c->s->ticks) {
-      c = cc;
+    if (ch == '\r') {
+      continue;
+    }
+
+    switch (c->parse) {
+      case HTTP_PARSE_METHOD:
+        if (ch == ' ') {
+          c->req_method[c->parse_len] = '\0';
+          c->parse = HTTP_PARSE_PATH;
+          c->parse_len = 0;
+        } else if (ch == '\n') {
+          // Blank lines before a request are allowed
+          if (c->parse_len > 0) {
+            c->req_error = 400;
+            c->parse = HTTP_PARSE_LINE;
+          }
+        } else if (c->parse_len < sizeof(c->req_method) - 1) {
+          c->req_method[c->parse_len++] = ch;
+        } else {
+          c->req_error = 400;
+          c->parse = HTTP_PARSE_SKIP;
+        }
+        break;
+
+      case HTTP_PARSE_PATH:
+        if (ch == ' ' || ch == '\n') {
+          c->req_file[c->parse_len] = '\0';
+          c->parse = ch == ' ' ? HTTP_PARSE_VERSION : HTTP_PARSE_LINE;
+          c->parse_word = "HTTP/1.1";
+          c->parse_len = 0;
+        } else if (c->parse_len < sizeof(c->req_file) - 2) {
+          c->req_file[c->parse_len++] = ch;
+        } else {
+          c->req_error = 414;
+          c->parse = HTTP_PARSE_SKIP;
+        }
+        break;
+
+      case HTTP_PARSE_VERSION:
+        // HTTP/1.1 keeps the connection open unless the client says
+        // otherwise, HTTP/1.0 only if it asks
+        if (ch == '\n') {
+          c->keep_alive = c->parse_len == 8;
+          c->parse = HTTP_PARSE_LINE;
+        } else if (c->parse_len < 8 && ch == c->parse_word[c->parse_len]) {
+          c->parse_len++;
+        } else {
+          c->parse_len = 0xFF;
+        }
+        break;
+
+      case HTTP_PARSE_LINE:
+        if (ch == '\n') {
+          http_request(c);
+          break;
+        }
+
+        if ((ch | 0x20) == 'c') {
+          c->parse_word = "connection:";
+        } else if ((ch | 0x20) == 'i' && !c->req_etag) {
+          c->parse_word = "if-none-match:";
+        } else {
+          c->parse = HTTP_PARSE_SKIP;
+          break;
+        }
+
+        c->parse = HTTP_PARSE_NAME;
+        c->parse_len = 0;
+        // Fall through
+
+      case HTTP_PARSE_NAME:
+        if (ch == '\n') {
+          c->parse = HTTP_PARSE_LINE;
+        } else if ((ch | 0x20) != c->parse_word[c->parse_len]) {
+          c->parse = HTTP_PARSE_SKIP;
+        } else if (!c->parse_word[++c->parse_len]) {
+          c->parse = c->parse_word[0] == 'c' ? HTTP_PARSE_VALUE : HTTP_PARSE_ETAG;
+          c->parse_word = NULL;
+          c->parse_len = 0;
+          c->req_etag_len = 0;
+          c->req_etag_hash = 0;
+        }
+        break;
+
+      case HTTP_PARSE_VALUE:
+        if (ch == '\n') {
+          c->parse = HTTP_PARSE_LINE;
+          break;
+        }
+
+        if (!c->parse_word) {
+          if (ch == ' ') {
+            break;
+          } else if ((ch | 0x20) == 'c') {
+            c->parse_word = "close";
+          } else if ((ch | 0x20) == 'k') {
+            c->parse_word = "keep-alive";
+          } else {
+            c->parse = HTTP_PARSE_SKIP;
+            break;
+          }
+        }
+
+        if ((ch | 0x20) != c->parse_word[c->parse_len]) {
+          c->parse = HTTP_PARSE_SKIP;
+        } else if (!c->parse_word[++c->parse_len]) {
+          c->keep_alive = c->parse_word[0] == 'k';
+          c->parse = HTTP_PARSE_SKIP;
+        }
+        break;
+
+      case HTTP_PARSE_ETAG:
+        // Only the first tag in the list is read, as a "LEN-HASH" pair like
+        // ours. A W/ in front makes no difference to If-None-Match.
+        if (ch == '\n') {
+          c->parse = HTTP_PARSE_LINE;
+          break;
+        }
+
+        if (c->parse_len == 0) {
+          if (ch == '*') {
+            c->req_etag = HTTP_ETAG_ANY;
+            c->parse = HTTP_PARSE_SKIP;
+          } else if (ch == '"') {
+            c->parse_len = 1;
+          } else if (ch != ' ' && ch != 'W' && ch != '/') {
+            c->parse = HTTP_PARSE_SKIP;
+          }
+          break;
+        }
+
+        if (ch == '-' && c->parse_len == 1) {
+          c->parse_len = 2;
+          break;
+        }
+
+        if (ch == '"' && c->parse_len == 2) {
+          c->req_etag = HTTP_ETAG_TAG;
+          c->parse = HTTP_PARSE_SKIP;
+          break;
+        }
+
+        if (ch >= '0' && ch <= '9') {
+          ch -= '0';
+        } else if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f') {
+          ch = (ch | 0x20) - 'a' + 10;
+        } else {
+          c->parse = HTTP_PARSE_SKIP;
+          break;
+        }
+
+        if (c->parse_len == 1) {
+          c->req_etag_len = (c->req_etag_len << 4) | ch;
+        } else {
+          c->req_etag_hash = (c->req_etag_hash << 4) | ch;
+        }
+        break;
+
+      case HTTP_PARSE_SKIP:
+        if (ch == '\n') {
+          c->parse = HTTP_PARSE_LINE;
+        }
+        break;
     }
   }
 
-  if (c->s) {
-    printf("Client limit reached: evicting %d.%d.%d.%d:%u ticks=%u\n",
-      c->s->daddr[0], c->s->daddr[1], c->s->daddr[2], c->s->daddr[3], c->s->dport, c->s->ticks);
+  return i;
+}
 
-    tcp_sock_close(c->s);
+void http_open(struct tcp_sock *s) {
+  struct http_client *c = NULL;
+  uint8_t i;
+
+  for (i = 0; i < HTTP_MAX_CLIENTS; i++) {
+    if (!http_client_table[i].s) {
+      c = &http_client_table[i];
+      break;
+    }
+  }
+
+  // The listener holds connections back in its backlog once we're full, so
+  // this shouldn't happen. Turn the newcomer away rather than a live client.
+  if (!c) {
+    tcp_tx_rst(s);
+    tcp_sock_close(s);
+    return;
   }
 
   memset(c, 0, sizeof(struct http_client));
@@ -253,76 +805,216 @@ void http_open(struct tcp_sock *s) {
   c->s = s;
   c->state = HTTP_RX_REQ;
   c->fd = -1;
+  c->idle_since = clock_ticks;
+}
+
+// A request is parsed as it arrives, so while one is read the whole window
+// is offered. While it's answered only what rx_buff has room for is.
+void http_rx_window(struct http_client *c) {
+  if (c->state == HTTP_RX_REQ) {
+    tcp_rx_window(c->s, TCP_PACKET_LEN);
+  } else {
+    tcp_rx_window(c->s, HTTP_RX_LEN - c->rx_cur);
+  }
 }
 
 void http_recv(struct tcp_sock *s, uint8_t *data, uint16_t len) {
   struct http_client *c = http_get_client(s);
+  uint16_t n;
 
   if (!c) {
     return;
   }
 
-  if (c->state != HTTP_RX_REQ) {
-    return;
+  if (c->state == HTTP_RX_REQ) {
+    c->idle_since = clock_ticks;
+    n = http_rx_parse(c, data, len);
+    data += n;
+    len -= n;
   }
 
-  if (c->rx_cur + len > HTTP_RX_LEN) {
-    http_system_response(c, 431, "Request Header Fields Too Large");
-    return;
+  // The next request on a kept open connection can arrive while the
+  // response to this one is still going out. It waits in rx_buff, which
+  // the window we advertise keeps from overflowing once a response has
+  // started. Only the segment that finished the request can bring more
+  // than that, and then the connection is closed after this response, as
+  // clients send unanswered requests again on a new one.
+  if (len > 0 && c->keep_alive) {
+    if (len > HTTP_RX_LEN - c->rx_cur) {
+      c->keep_alive = 0;
+    } else {
+      memcpy(&c->rx_buff[c->rx_cur], data, len);
+      c->rx_cur += len;
+    }
   }
 
-  memcpy(&c->rx_buff[c->rx_cur], data, len);
+  http_rx_window(c);
+}
 
-  c->rx_cur += len;
+// Stream offset just past the end of the response, relative to tx_base
+uint32_t http_tx_end(struct http_client *c) {
+  return c->hdr_len + (c->fd >= 0 || c->cache ? c->tx_len : 0);
+}
 
-  http_parse_request(c);
+// The last of the response goes out. Unless the connection is kept open for
+// another request, our FIN goes with it.
+void http_send_end(struct http_client *c, uint8_t *buffer, uint16_t len) {
+  if (!c->keep_alive) {
+    tcp_tx_data_fin(c->s, buffer, len);
+  } else if (len > 0) {
+    tcp_tx_data(c->s, buffer, len);
+  } else {
+    tcp_tx_flush(c->s);
+  }
+
+  c->state = HTTP_TX_DONE;
 }
 
+// The response on "c" has been acknowledged, so it won't be asked for again.
+// Move on to the next request, which may have arrived already. Returns 1 if
+// there's a response to it to send.
+uint8_t http_next(struct http_client *c) {
+  uint16_t n;
+
+  c->tx_base += http_tx_end(c);
+  c->hdr_len = 0;
+
+  if (c->fd >= 0) {
+    close(c->fd);
+    c->fd = -1;
+  }
+
+  http_cache_release(c);
+
+  c->state = HTTP_RX_REQ;
+  c->idle_since = clock_ticks;
+
+  http_rx_reset(c);
+  n = http_rx_parse(c, (uint8_t *)c->rx_buff, c->rx_cur);
+  c->rx_cur -= n;
+
+  // Anything after a request that closes the connection is dropped
+  if (!c->keep_alive) {
+    c->rx_cur = 0;
+  }
+
+  memmove(c->rx_buff, c->rx_buff + n, c->rx_cur);
+  http_rx_window(c);
+
+  return c->state != HTTP_RX_REQ;
+}
+
+// Segments can be asked for again after they're lost, so where the next one
+// starts is worked out from the socket rather than kept here
 void http_send(struct tcp_sock *s, uint16_t len) {
   struct http_client *c = http_get_client(s);
+  uint8_t *buffer;
+  uint32_t offset;
+  uint16_t hdr_len;
 
-  if (!c) {
+  if (!c || c->state == HTTP_RX_REQ) {
     return;
   }
 
-  switch (c->state) {
-    case HTTP_TX_HDR:
-      if (c->fd < 0) {
-        tcp_tx_data_fin(c->s, http_tx_buffer, strlen((char *)http_tx_buffer));
-      } else {
-        tcp_tx_data(c->s, http_tx_buffer, strlen((char *)http_tx_buffer));
-        c->state = HTTP_TX_BODY;
-        c->tx_cur = 0;
-      }
-      break;
+  // Headers and file data are written directly into the outgoing segment
+  buffer = tcp_tx_payload(s);
+  offset = tcp_tx_offset(s) - c->tx_base;
 
-    case HTTP_TX_BODY:
-      if (len > TCP_PACKET_LEN) {
-        len = TCP_PACKET_LEN;
-      }
+  // Nothing of the response was lost. Once it's all acknowledged a kept
+  // open connection moves on to the next request.
+  if (c->state == HTTP_TX_DONE && offset >= http_tx_end(c)) {
+    if (!c->keep_alive || !tcp_tx_acked(s) || !http_next(c)) {
+      return;
+    }
 
-      lseek(c->fd, c->tx_cur, SEEK_SET);
+    offset = 0;
+  }
 
-      len = read(c->fd, http_tx_buffer, len);
+  if (c->state == HTTP_TX_HDR || offset < c->hdr_len) {
+    if (len > tcp_tx_space(s)) {
+      len = tcp_tx_space(s);
+    }
 
-      if (len > 0) {
-        c->tx_cur += len;
+    c->hdr_len = http_header(c, (char *)buffer);
 
-        if (c->tx_cur >= c->tx_len) {
-          tcp_tx_data_fin(c->s, http_tx_buffer, len);
-          close(c->fd);
-          c->fd = -1;
-        } else {
-          tcp_tx_data(c->s, http_tx_buffer, len);
-        }
-      } else {
-        // EOF or read error - abort the connection
-        close(c->fd);
-        c->fd = -1;
-        tcp_tx_rst(c->s);
-        tcp_sock_close(c->s);
-      }
-      break;
+    // Only the end of the header was lost
+    hdr_len = c->hdr_len - offset;
+
+    if (offset > 0) {
+      memmove(buffer, buffer + offset, hdr_len);
+    }
+
+    // The peer's window won't take all of it, so the rest is sent once
+    // this is acknowledged
+    if (hdr_len > len) {
+      tcp_tx_data(s, buffer, len);
+      return;
+    }
+
+    if (c->fd < 0 && !c->cache) {
+      http_send_end(c, buffer, hdr_len);
+      return;
+    }
+
+    // Corked, so the start of the body goes out in the same segment
+    tcp_tx_data_more(s, buffer, hdr_len);
+    c->state = HTTP_TX_BODY;
+
+    if (len <= hdr_len) {
+      return;
+    }
+
+    len -= hdr_len;
+    offset = c->hdr_len;
+    buffer = tcp_tx_payload(s);
+  }
+
+  c->tx_cur = offset - c->hdr_len;
+
+  if (c->tx_cur >= c->tx_len) {
+    http_send_end(c, buffer, 0);
+    return;
+  }
+
+  if (len > tcp_tx_space(s)) {
+    len = tcp_tx_space(s);
+  }
+
+  if (len == 0) {
+    return;
+  }
+
+  if (c->cache) {
+    if (len > c->tx_len - c->tx_cur) {
+      len = c->tx_len - c->tx_cur;
+    }
+
+    memcpy(buffer, &c->cache->data[c->cache->hdr_len + c->tx_cur], len);
+  } else {
+    lseek(c->fd, c->tx_cur, SEEK_SET);
+
+    len = read(c->fd, buffer, len);
+  }
+
+  if (len > 0) {
+    // Resent data has already been summed
+    if (c->hashing && c->tx_cur == c->hash_pos) {
+      http_hash_add(c, buffer, len);
+    }
+
+    c->tx_cur += len;
+
+    // The file stays open until the response is acknowledged, in case the
+    // end has to be sent again
+    if (c->tx_cur >= c->tx_len) {
+      http_send_end(c, buffer, len);
+    } else {
+      tcp_tx_data(s, buffer, len);
+    }
+  } else {
+    // EOF or read error - abort the connection
+    tcp_tx_rst(s);
+    tcp_sock_close(s);
   }
 }
 
@@ -337,5 +1029,32 @@ void http_close(struct tcp_sock *s) {
     close(c->fd);
   }
 
+  http_cache_release(c);
+
   memset(c, 0, sizeof(struct http_client));
 }
+
+// Called on every pass of the main loop. Connections that have waited
+// HTTP_IDLE_TICKS for a request are closed to make way for clients queued
+// in the listen backlog.
+void http_poll(void) {
+  struct http_client *c;
+  uint8_t i;
+
+  if (http_poll_clock == clock_ticks) {
+    return;
+  }
+
+  http_poll_clock = clock_ticks;
+
+  for (i = 0; i < HTTP_MAX_CLIENTS; i++) {
+    c = &http_client_table[i];
+
+    if (c->s && c->state == HTTP_RX_REQ && (uint16_t)(clock_ticks - c->idle_since) >= HTTP_IDLE_TICKS) {
+      c->state = HTTP_TX_DONE;
+      c->keep_alive = 0;
+
+      tcp_close(c->s);
+    }
+  }
+}
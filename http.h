@@ -2,39 +2,141 @@
 #define __HTTP_H__
 
 #define HTTP_MAX_CLIENTS 4
-#define HTTP_RX_LEN 1024
+#define HTTP_RX_LEN 256 // Pipelined requests held while a response goes out
+#define HTTP_REQ_MAX 1024 // Longest request we read through
+#define HTTP_MAX_REQUESTS 16 // Requests on one connection before it's closed
+#define HTTP_IDLE_TICKS (5 * CLOCK_HZ) // Wait for a request before closing the connection
+
+// Responses for small files are kept in memory, up to HTTP_CACHE_BUDGET
+// bytes of header and body across HTTP_CACHE_ENTRIES files
+#ifndef HTTP_CACHE_BUDGET
+#define HTTP_CACHE_BUDGET 8192
+#endif
+
+#ifndef HTTP_CACHE_ENTRIES
+#define HTTP_CACHE_ENTRIES 8
+#endif
+
+#define HTTP_CACHE_FILE_MAX (HTTP_CACHE_BUDGET / 2) // Largest file cached
+#define HTTP_CACHE_HDR_LEN 128 // Room for the cached part of a header
+
+// Files on the drive that can be served, listed when the server starts
+#ifndef HTTP_INDEX_MAX
+#define HTTP_INDEX_MAX 64
+#endif
 
 #define HTTP_RX_REQ 0
 #define HTTP_TX_HDR 1
 #define HTTP_TX_BODY 2
+#define HTTP_TX_DONE 3 // Response sent, waiting for it to be acknowledged
+
+// Request parser states
+#define HTTP_PARSE_METHOD 0
+#define HTTP_PARSE_PATH 1
+#define HTTP_PARSE_VERSION 2
+#define HTTP_PARSE_LINE 3 // Start of a header line, or the blank line at the end
+#define HTTP_PARSE_NAME 4 // Header name, while it matches "Connection:"
+#define HTTP_PARSE_VALUE 5 // Connection header value
+#define HTTP_PARSE_SKIP 6 // Rest of a line we don't need
+#define HTTP_PARSE_ETAG 7 // If-None-Match header value
+
+// What an If-None-Match header asked for
+#define HTTP_ETAG_NONE 0
+#define HTTP_ETAG_ANY 1 // "*"
+#define HTTP_ETAG_TAG 2 // req_etag_len and req_etag_hash
 
 #define HTTP_FILE_MODE_TEXT 0
 #define HTTP_FILE_MODE_BINARY 1
 
+struct http_file {
+  char name[13]; // NAME.EXT
+  uint8_t mode;
+  const char *type;
+  uint32_t len; // As served, so up to the ^Z for text files
+  uint8_t sized; // Clear if the file couldn't be opened to find len
+  uint32_t hash; // Of what's served, which with len makes the ETag
+  uint8_t hashed; // Set once the file has been sent in full and hash is known
+};
+
+struct http_cache_entry {
+  char file[15];
+  uint8_t users; // Clients sending from it, which keep it from being evicted
+  uint16_t used; // http_cache_clock when last requested
+  uint16_t hdr_len; // Header up to the ETag and Connection lines
+  uint16_t len; // Body, which follows the header in data
+  uint8_t *data;
+};
+
 struct http_client {
   struct tcp_sock *s;
   uint8_t state;
+  uint8_t keep_alive;
+  uint8_t requests;
+  uint16_t idle_since; // clock_ticks when we started waiting for a request
   char rx_buff[HTTP_RX_LEN];
   uint16_t rx_cur;
+  uint8_t parse;
+  uint8_t parse_len; // Characters of the current token so far
+  const char *parse_word; // What the current token is being matched against
+  uint16_t req_len;
+  uint16_t req_error; // Response code for a request found to be bad
+  uint8_t req_etag;
+  uint32_t req_etag_len;
+  uint32_t req_etag_hash;
   char req_method[8];
   char req_file[15];
   uint8_t file_mode;
+  const char *type;
+  uint8_t etag; // Whether the header carries hash
+  uint32_t hash;
+  uint8_t hashing; // Summing the body as it goes out, for the index
+  uint32_t hash_pos; // How much of the body has been summed
+  uint16_t hash_sum1;
+  uint16_t hash_sum2;
+  uint16_t code;
+  char *message;
+  uint32_t tx_base; // Stream offset the response starts at
+  uint16_t hdr_len;
   uint32_t tx_len;
   uint32_t tx_cur;
   int16_t fd;
+  struct http_cache_entry *cache; // Where the body comes from instead of fd
 };
 
+extern struct http_file http_index[HTTP_INDEX_MAX];
+extern uint8_t http_index_len;
+extern uint16_t http_cache_hits;
+extern uint16_t http_cache_misses;
+
 void http_init(void);
 struct http_client *http_get_client(struct tcp_sock *s);
 void http_log(struct http_client *c, uint16_t code);
 void http_system_response(struct http_client *c, uint16_t code, char *message);
-char *http_content_type(struct http_client *c);
-uint8_t http_file_mode(struct http_client *c);
-int16_t http_file_open(struct http_client *c);
-uint32_t http_content_length(struct http_client *c, int16_t fd);
+uint16_t http_header(struct http_client *c, char *buffer);
+char *http_content_type(char *name);
+uint8_t http_file_mode(char *name);
+int16_t http_file_open(char *name, uint8_t file_mode);
+uint32_t http_content_length(int16_t fd, uint8_t file_mode);
+struct http_cache_entry *http_cache_find(char *file);
+struct http_cache_entry *http_cache_alloc(uint16_t len);
+struct http_cache_entry *http_cache_fill(struct http_client *c);
+void http_cache_drop(struct http_cache_entry *e);
+void http_cache_flush(void);
+void http_cache_release(struct http_client *c);
+struct http_file *http_index_find(char *name);
+void http_index_name(char *name, uint8_t *entry);
+void http_hash_add(struct http_client *c, uint8_t *data, uint16_t len);
+void http_index_build(void);
 void http_response(struct http_client *c);
-void http_parse_request(struct http_client *c);
+void http_request(struct http_client *c);
+void http_rx_reset(struct http_client *c);
+uint16_t http_rx_parse(struct http_client *c, uint8_t *data, uint16_t len);
+uint32_t http_tx_end(struct http_client *c);
+void http_send_end(struct http_client *c, uint8_t *buffer, uint16_t len);
+uint8_t http_next(struct http_client *c);
+void http_poll(void);
 void http_open(struct tcp_sock *s);
+void http_rx_window(struct http_client *c);
 void http_recv(struct tcp_sock *s, uint8_t *data, uint16_t len);
 void http_send(struct tcp_sock *s, uint16_t len);
 void http_close(struct tcp_sock *s);
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "slip.h"
+#include "clock.h"
 #include "ip.h"
 #include "tcp.h"
 #include "http.h"
@@ -20,6 +21,7 @@ int main(int argc, char *argv[]) {
   uint16_t port = 80;
   uint8_t debug = 0;
   uint8_t verbose = 0;
+  uint16_t ticks = 0;
 
   for (i = 0; i < argc; i++) {
     if (!argv[i]) {
@@ -44,6 +46,7 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  clock_init();
   ip_init();
   http_init();
 
@@ -51,11 +54,27 @@ int main(int argc, char *argv[]) {
     ip_debug_enable(verbose);
   }
 
-  tcp_listen(port, http_open, http_recv, http_send, http_close);
+  tcp_listen(port, HTTP_MAX_CLIENTS, http_open, http_recv, http_send, http_close);
 
-  printf("Listening on port %u...\n\n", port);
+  printf("Listening on port %u...\n", port);
+  printf("Press R to rescan the drive\n\n");
 
   while (1) {
     slip_rx();
+    clock_poll();
+    tcp_poll();
+    http_poll();
+
+    // The console is only checked once a tick
+    if (ticks != clock_ticks) {
+      ticks = clock_ticks;
+
+      switch (bdos(CPM_DCIO, 0xFF)) {
+        case 'R':
+        case 'r':
+          http_index_build();
+          break;
+      }
+    }
   }
 }
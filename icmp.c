@@ -23,7 +23,7 @@ void icmp_debug(struct ip_hdr *iph) {
 void icmp_rx(struct ip_hdr *iph) {
   struct icmp_hdr *icmph = (struct icmp_hdr *)ip_data(iph);
   uint16_t icmp_len = ip_data_len(iph);
-  uint16_t csum = checksum((uint16_t *)icmph, icmp_len, 0);
+  uint16_t csum = ip_rx_data_checksum(iph, icmp_len, 0);
 
   if (csum != 0 && csum != 0xFFFF) {
     return;
@@ -15,6 +15,9 @@
 #ifdef ENABLE_UDP
 #include "udp.h"
 #endif
+#ifdef SLIP_CSLIP
+#include "cslip.h"
+#endif
 
 const uint8_t local_address[4] = {192, 168, 1, 51};
 const uint8_t gateway_address[4] = {192, 168, 1, 1};
@@ -22,6 +25,10 @@ uint16_t packet_id = 0;
 uint8_t debug_enabled = 0;
 uint8_t debug_verbose = 0;
 
+// Ones-complement sum of the payload of the packet being received, as
+// accumulated by the SLIP decoder. 0 when it has to be computed instead.
+uint16_t ip_rx_data_sum = 0;
+
 uint8_t *ip_data(struct ip_hdr *iph) {
   return (uint8_t *)iph + ip_hl(iph);
 }
@@ -30,9 +37,217 @@ uint16_t ip_data_len(struct ip_hdr *iph) {
   return iph->len - ip_hl(iph);
 }
 
+#ifdef IP_CSUM_ASM
+// The kernels below keep the sum in DE and add a byte at a time through A so
+// the carry runs unbroken from one word to the next and is only folded back
+// in once at the end. The pointer walks in HL, which none of the adds touch.
+
+// Compute Internet Checksum for "count" bytes beginning at location "addr".
+uint16_t checksum(uint16_t *addr, uint16_t count, uint16_t offset) __naked __z88dk_callee {
+  __asm
+    pop af                      ; return address
+    pop de                      ; de = offset
+    pop bc                      ; bc = count
+    pop hl                      ; hl = addr
+    push af
+
+    push bc                     ; low bits of count are needed for the tail
+
+    srl b
+    rr c
+    srl b
+    rr c                        ; bc = number of 4 byte blocks
+
+    ld a,b                      ; djnz counts down the low byte in b and
+    ld b,c                      ; c counts the passes of 256 blocks
+    ld c,a
+    ld a,b
+    or a
+    jr z,checksum_count
+    inc c
+
+  checksum_count:
+    ld a,c
+    or a                        ; also clears carry for the first adc
+    jr z,checksum_tail
+
+  checksum_loop:
+    ld a,e
+    adc a,(hl)
+    ld e,a
+    inc hl
+    ld a,d
+    adc a,(hl)
+    ld d,a
+    inc hl
+    ld a,e
+    adc a,(hl)
+    ld e,a
+    inc hl
+    ld a,d
+    adc a,(hl)
+    ld d,a
+    inc hl
+    djnz checksum_loop
+    dec c
+    jr nz,checksum_loop
+
+  checksum_tail:
+    pop bc
+    bit 1,c
+    jr z,checksum_tail_byte
+    ld a,e
+    adc a,(hl)
+    ld e,a
+    inc hl
+    ld a,d
+    adc a,(hl)
+    ld d,a
+    inc hl
+
+  checksum_tail_byte:
+    bit 0,c
+    jr z,checksum_fold
+    ld a,e
+    adc a,(hl)
+    ld e,a
+    ld a,d
+    adc a,0
+    ld d,a
+
+  checksum_fold:
+    ex de,hl
+    ld de,0
+    adc hl,de                   ; add back the last carry
+    adc hl,de                   ; which can carry once more
+
+    ld a,l
+    cpl
+    ld l,a
+    ld a,h
+    cpl
+    ld h,a
+    ret
+  __endasm;
+}
+
+// Checksum of a 20 byte IP header with no options
+uint16_t checksum_ip_hdr(struct ip_hdr *iph) __naked __z88dk_fastcall {
+  __asm
+    xor a
+    ld d,a
+    ld e,a
+    ld b,5
+
+  checksum_ip_hdr_loop:
+    ld a,e
+    adc a,(hl)
+    ld e,a
+    inc hl
+    ld a,d
+    adc a,(hl)
+    ld d,a
+    inc hl
+    ld a,e
+    adc a,(hl)
+    ld e,a
+    inc hl
+    ld a,d
+    adc a,(hl)
+    ld d,a
+    inc hl
+    djnz checksum_ip_hdr_loop
+
+    ex de,hl
+    ld de,0
+    adc hl,de
+    adc hl,de
+
+    ld a,l
+    cpl
+    ld l,a
+    ld a,h
+    cpl
+    ld h,a
+    ret
+  __endasm;
+}
+
+// Sum of the 12 byte TCP/UDP pseudo-header for a "len" byte segment, taken
+// straight from the IP header. Not complemented, ready to pass as the
+// offset to checksum().
+uint16_t checksum_pseudo(struct ip_hdr *iph, uint16_t len) __naked __z88dk_callee {
+  __asm
+    pop af                      ; return address
+    pop bc                      ; bc = len
+    pop hl                      ; hl = iph
+    push af
+
+    push bc
+    ld de,9
+    add hl,de
+    pop de
+
+    ld b,(hl)                   ; bc = zero byte and protocol
+    ld c,0
+    inc hl
+    inc hl
+    inc hl                      ; hl = saddr, followed by daddr
+
+    ld a,d                      ; de = len in network byte order
+    ld d,e
+    ld e,a
+
+    ex de,hl
+    add hl,bc
+    ex de,hl
+
+    ld a,e
+    adc a,(hl)
+    ld e,a
+    inc hl
+    ld a,d
+    adc a,(hl)
+    ld d,a
+    inc hl
+    ld a,e
+    adc a,(hl)
+    ld e,a
+    inc hl
+    ld a,d
+    adc a,(hl)
+    ld d,a
+    inc hl
+    ld a,e
+    adc a,(hl)
+    ld e,a
+    inc hl
+    ld a,d
+    adc a,(hl)
+    ld d,a
+    inc hl
+    ld a,e
+    adc a,(hl)
+    ld e,a
+    inc hl
+    ld a,d
+    adc a,(hl)
+    ld d,a
+    inc hl
+
+    ex de,hl
+    ld de,0
+    adc hl,de
+    adc hl,de
+    ret
+  __endasm;
+}
+#else
+// These keep the calling conventions ip.h declares for the Z80 versions
+
 // Compute Internet Checksum for "count" bytes beginning at location "addr".
 // Taken from https://tools.ietf.org/html/rfc1071
-uint16_t checksum(uint16_t *addr, uint16_t count, uint32_t offset) {
+uint16_t checksum(uint16_t *addr, uint16_t count, uint16_t offset) __smallc __z88dk_callee {
   uint32_t sum = offset;
   uint16_t *ptr = addr;
 
@@ -52,6 +267,45 @@ uint16_t checksum(uint16_t *addr, uint16_t count, uint32_t offset) {
   return ~sum;
 }
 
+uint16_t checksum_ip_hdr(struct ip_hdr *iph) __z88dk_fastcall {
+  return checksum((uint16_t *)iph, 20, 0);
+}
+
+uint16_t checksum_pseudo(struct ip_hdr *iph, uint16_t len) __smallc __z88dk_callee {
+  uint8_t hdr[12];
+
+  memcpy(hdr, iph->saddr, 8);
+
+  hdr[8] = 0;
+  hdr[9] = iph->proto;
+  hdr[10] = len >> 8;
+  hdr[11] = len;
+
+  return ~checksum((uint16_t *)hdr, 12, 0);
+}
+#endif
+
+// Ones-complement sum of two partial sums
+uint16_t checksum_add(uint16_t a, uint16_t b) {
+  uint16_t sum = a + b;
+
+  if (sum < a) {
+    sum++;
+  }
+
+  return sum;
+}
+
+// Checksum "len" bytes of received payload on top of "offset". Uses the sum
+// from the SLIP decoder when it covers exactly those bytes.
+uint16_t ip_rx_data_checksum(struct ip_hdr *iph, uint16_t len, uint16_t offset) {
+  if (ip_rx_data_sum && len == ip_data_len(iph)) {
+    return ~checksum_add(offset, ip_rx_data_sum);
+  }
+
+  return checksum((uint16_t *)ip_data(iph), len, offset);
+}
+
 uint8_t *ip_proto_s(uint8_t proto) {
   switch (proto) {
     case ICMP: return "ICMP";
@@ -133,12 +387,13 @@ void ip_debug(struct ip_hdr *iph) {
 }
 
 struct ip_hdr *ip_hdr_init(void) {
-  struct ip_hdr *iph = slip_tx_buffer;
+  struct ip_hdr *iph = (struct ip_hdr *)slip_tx_packet();
 
-  memset(iph, 0, SLIP_MAX);
+  // Only the IP header and room for the largest transport header are
+  // cleared. The payload may already have been written by the caller.
+  memset(iph, 0, 20 + 20);
 
   iph->version_ihl = (IPV4 << 4) | 5;  // version 4, header length 5 (20 bytes)
-  iph->id = htons(packet_id++);
   iph->frag_offset = 0x0040;
   iph->ttl = 64;
 
@@ -147,18 +402,39 @@ struct ip_hdr *ip_hdr_init(void) {
   return iph;
 }
 
-void ip_rx(struct ip_hdr *iph) {
-  uint16_t csum = checksum((uint16_t *)iph, ip_ihl(iph) * 4, 0);
+// Fill in an IP header with everything that stays the same for packets of
+// "proto" to "daddr". Its checksum is taken with len and id still zero, so
+// ip_tx() only has to add those two in rather than summing the header.
+void ip_hdr_template(struct ip_hdr *iph, uint8_t *daddr, uint8_t proto) {
+  memset(iph, 0, 20);
 
+  iph->version_ihl = (IPV4 << 4) | 5;
+  iph->frag_offset = 0x0040;
+  iph->ttl = 64;
+  iph->proto = proto;
+
+  memcpy(iph->saddr, local_address, 4);
+  memcpy(iph->daddr, daddr, 4);
+
+  iph->csum = checksum_ip_hdr(iph);
+}
+
+void ip_rx(struct ip_hdr *iph) {
   if (ip_version(iph) != IPV4) return;
   if (ip_ihl(iph) < 5) return;
   if (iph->ttl == 0) return;
-  if (csum != 0) return;
+
+  // The decoder summed the header as it arrived, a valid one sums to 0xFFFF
+  if (slip_rx_frame->csum_hdr != 0xFFFF) return;
 
   iph->len = ntohs(iph->len);
 
   if (iph->len > SLIP_MTU) return;
 
+  // Once the header checks out it adds nothing to the sum of the whole
+  // frame, which leaves the sum of the payload
+  ip_rx_data_sum = (slip_rx_frame->len == iph->len) ? slip_rx_frame->csum : 0;
+
   ip_debug(iph);
 
   switch (iph->proto) {
@@ -188,7 +464,21 @@ void ip_tx(struct ip_hdr *iph) {
   ip_debug(iph);
 
   iph->len = htons(len);
-  iph->csum = checksum((uint16_t *)iph, 20, 0);
+  iph->id = htons(packet_id++);
+
+  // Headers built from ip_hdr_template() arrive with their fixed fields summed
+  if (iph->csum) {
+    iph->csum = ~checksum_add(checksum_add(~iph->csum, iph->len), iph->id);
+  } else {
+    iph->csum = checksum_ip_hdr(iph);
+  }
+
+  #ifdef SLIP_CSLIP
+  if (iph->proto == TCP) {
+    cslip_tx(iph, len);
+    return;
+  }
+  #endif
 
   slip_tx((uint8_t *)iph, len);
 }
@@ -34,13 +34,18 @@ extern uint16_t __LIB__ htons(uint16_t x) __smallc __z88dk_fastcall;
 
 uint8_t *ip_data(struct ip_hdr *iph);
 uint16_t ip_data_len(struct ip_hdr *iph);
-uint16_t checksum(uint16_t *addr, uint16_t count, uint32_t offset);
+uint16_t checksum(uint16_t *addr, uint16_t count, uint16_t offset) __smallc __z88dk_callee;
+uint16_t checksum_ip_hdr(struct ip_hdr *iph) __z88dk_fastcall;
+uint16_t checksum_pseudo(struct ip_hdr *iph, uint16_t len) __smallc __z88dk_callee;
+uint16_t checksum_add(uint16_t a, uint16_t b);
+uint16_t ip_rx_data_checksum(struct ip_hdr *iph, uint16_t len, uint16_t offset);
 uint8_t *ip_proto_s(uint8_t proto);
 void ip_init(void);
 void ip_debug_enable(uint8_t verbose);
 void ip_debug_disable(void);
 void ip_debug(struct ip_hdr *iph);
 struct ip_hdr *ip_hdr_init(void);
+void ip_hdr_template(struct ip_hdr *iph, uint8_t *daddr, uint8_t proto);
 void ip_rx(struct ip_hdr *iph);
 void ip_tx(struct ip_hdr *iph);
 
@@ -3,6 +3,13 @@
 #include <string.h>
 #include "slip.h"
 #include "ip.h"
+#ifdef SLIP_CSLIP
+#include "cslip.h"
+#endif
+
+#ifdef SLIP_BIOS_RING
+#include <intrinsic.h>
+#endif
 
 uint8_t *slip_rx_buffer;
 uint8_t *slip_tx_buffer;
@@ -10,21 +17,87 @@ uint8_t *slip_tx_buffer;
 uint16_t slip_rx_length;
 uint8_t slip_rx_escaped;
 uint8_t slip_tx_sent;
+uint8_t slip_tx_busy;
+
+// Ring of received frames. The decoder fills the slot at head while the
+// frame at tail is handed to ip_rx(), so bytes keep being drained while a
+// packet is processed.
+struct slip_frame *slip_rx_slots;
+struct slip_frame *slip_rx_frame;
+uint8_t slip_rx_head;
+uint8_t slip_rx_tail;
+uint8_t slip_rx_count;
+
+uint16_t slip_rx_frames;
+uint16_t slip_rx_dropped;
+
+// Bytes taken off the serial port and decoded, wrapping, and the count as
+// of the last credit frame sent to the gateway
+uint16_t slip_rx_bytes;
+uint16_t slip_rx_credited;
+
+#define slip_credit_due() (slip_rx_count < SLIP_RX_SLOTS && slip_rx_bytes - slip_rx_credited >= SLIP_CREDIT_UPDATE)
+
+// Running ones-complement sums of the frame being decoded, so the IP and
+// transport layers don't have to walk the packet again to verify it
+uint16_t slip_rx_csum;
+uint16_t slip_rx_csum_hdr;
+uint8_t slip_rx_hdr_len;
+
+// Bytes pulled off the serial port but not yet fed to the decoder
+uint8_t slip_rx_block[BIOS_RX_BUFSIZE];
+uint8_t slip_rx_block_len;
+uint8_t slip_rx_block_pos;
+
+// Second byte of the escape sequence for each byte value, 0 if it goes out as is
+uint8_t slip_tx_escape[256];
 
 void slip_init(void) {
-  slip_rx_buffer = slip_buffer_alloc();
+  slip_rx_slots = calloc(SLIP_RX_SLOTS, sizeof(struct slip_frame));
   slip_tx_buffer = slip_buffer_alloc();
 
-  slip_rx_length = 0;
-  slip_rx_escaped = 0;
+  slip_rx_head = 0;
+  slip_rx_tail = 0;
+  slip_rx_count = 0;
+
+  slip_rx_frames = 0;
+  slip_rx_dropped = 0;
+
+  slip_rx_bytes = 0;
+  slip_rx_credited = 0;
+  slip_tx_busy = 0;
+
+  slip_rx_buffer = slip_rx_slots[0].data;
+
+  slip_reset();
+
+  slip_rx_block_len = 0;
+  slip_rx_block_pos = 0;
+
+  slip_tx_escape[SLIP_END] = SLIP_ESC_END;
+  slip_tx_escape[SLIP_ESC] = SLIP_ESC_ESC;
+
+  #ifdef SLIP_CSLIP
+  cslip_init();
+  #endif
+
+  // Let the gateway know it can start sending
+  slip_rx_enable(1);
+  slip_tx_credit();
 }
 
 void slip_reset(void) {
   slip_rx_length = 0;
   slip_rx_escaped = 0;
+
+  slip_rx_csum = 0;
+  slip_rx_csum_hdr = 0;
+  slip_rx_hdr_len = 0;
 }
 
 uint8_t slip_rx_decode(uint8_t b) {
+  uint16_t w;
+
   if (b == SLIP_END) {
     if (slip_rx_length > 0) {
       return SLIP_DECODE_DONE;
@@ -44,65 +117,339 @@ uint8_t slip_rx_decode(uint8_t b) {
     slip_rx_escaped = 0;
   }
 
+  if (slip_rx_length >= SLIP_MTU) {
+    return SLIP_DECODE_RST;
+  }
+
+  // Bytes at even offsets are the low half of each little-endian word
+  w = (slip_rx_length & 1) ? (uint16_t)b << 8 : b;
+
+  slip_rx_csum += w;
+
+  if (slip_rx_csum < w) {
+    slip_rx_csum++;
+  }
+
+  if (slip_rx_length == 0) {
+    slip_rx_hdr_len = (b & 0x0F) * 4;
+  }
+
   slip_rx_buffer[slip_rx_length++] = b;
 
-  if (slip_rx_length >= SLIP_MAX) {
-    return SLIP_DECODE_RST;
+  if (slip_rx_length == slip_rx_hdr_len) {
+    slip_rx_csum_hdr = slip_rx_csum;
   }
 
   return SLIP_DECODE_OK;
 }
 
-void slip_rx(void) {
-  uint8_t c;
+// Queue the frame just decoded for slip_rx() and move the decoder on to the
+// next slot
+void slip_rx_commit(void) {
+  struct slip_frame *f = &slip_rx_slots[slip_rx_head];
+
+  f->len = slip_rx_length;
+  f->csum = slip_rx_csum;
+  f->csum_hdr = slip_rx_csum_hdr;
+
+  if (++slip_rx_head == SLIP_RX_SLOTS) {
+    slip_rx_head = 0;
+  }
+
+  slip_rx_count++;
+  slip_rx_frames++;
+
+  if (slip_rx_count == SLIP_RX_SLOTS) {
+    slip_rx_enable(0);
+  }
+
+  slip_rx_buffer = slip_rx_slots[slip_rx_head].data;
+}
+
+#ifdef SLIP_BIOS_RING
+// Copy everything waiting in the BIOS ring into slip_rx_block and release it
+// in one go. Returns the number of bytes copied, 0 if the ring was empty.
+uint8_t slip_rx_fill(void) {
+  uint8_t *rdptr = *(uint8_t **)BIOS_RX_RDPTR;
+  uint8_t *end = (uint8_t *)(BIOS_RX_BUF + BIOS_RX_BUFSIZE);
+  uint8_t n = *(volatile uint8_t *)BIOS_RX_BUFUSED;
+  uint8_t i;
+
+  for (i = 0; i < n; i++) {
+    slip_rx_block[i] = *rdptr++;
+
+    if (rdptr == end) {
+      rdptr = (uint8_t *)BIOS_RX_BUF;
+    }
+  }
+
+  // The interrupt handler increments the used count, so the decrement has
+  // to happen with interrupts off
+  intrinsic_di();
+  *(uint8_t **)BIOS_RX_RDPTR = rdptr;
+  *(volatile uint8_t *)BIOS_RX_BUFUSED -= n;
+  intrinsic_ei();
+
+  return n;
+}
+#else
+// Fallback for BIOSes that don't expose the receive ring - blocks until a
+// byte arrives.
+uint8_t slip_rx_fill(void) {
+  slip_rx_block[0] = bdos(CPM_RRDR, 0);
+  return 1;
+}
+#endif
+
+// Decode whatever the serial port has waiting into free slots. Called from
+// slip_tx() as well, so it must not process anything itself. Without
+// SLIP_BIOS_RING reads block, so it returns as soon as a frame is queued.
+//
+// Once every slot holds a frame, the rest of the block and anything still in
+// the BIOS ring wait there for a slot to free up. Only decoded bytes are
+// credited, so the gateway can't send more than the ring holds meanwhile.
+void slip_rx_poll(void) {
+  uint8_t b;
   uint8_t status;
 
+  if (slip_rx_count == SLIP_RX_SLOTS) {
+    return;
+  }
+
   while (1) {
-    c = bdos(CPM_RRDR, 0);
-    status = slip_rx_decode(c);
+    if (slip_rx_block_pos == slip_rx_block_len) {
+      slip_rx_bytes += slip_rx_block_len;
+      slip_rx_block_pos = 0;
+      slip_rx_block_len = 0;
 
-    if (status == SLIP_DECODE_DONE) {
-      slip_tx_sent = 0;
+      // A credit frame can't go out in the middle of one of our own
+      if (!slip_tx_busy && slip_credit_due()) {
+        slip_tx_credit();
+      }
 
-      ip_rx((struct ip_hdr *)slip_rx_buffer);
+      slip_rx_block_len = slip_rx_fill();
 
-      if (!slip_tx_sent) {
-        slip_tx(NULL, 0);
+      if (slip_rx_block_len == 0) {
+        return;
       }
 
+      // The ring has room again. Only conin raises RTS after the BIOS has
+      // dropped it, and reading the ring directly bypasses that.
+      #ifdef SLIP_BIOS_RING
+      slip_rx_enable(1);
+      #endif
+    }
+
+    b = slip_rx_block[slip_rx_block_pos++];
+
+    status = slip_rx_decode(b);
+
+    if (status == SLIP_DECODE_DONE) {
+      slip_rx_commit();
       slip_reset();
 
+      #ifndef SLIP_BIOS_RING
       return;
+      #endif
+
+      if (slip_rx_count == SLIP_RX_SLOTS) {
+        return;
+      }
     } else if (status == SLIP_DECODE_RST) {
       slip_reset();
-      return;
+      slip_rx_dropped++;
+
+      #ifdef SLIP_CSLIP
+      cslip_rx_toss = 1;
+      #endif
+    }
+  }
+}
+
+#ifdef SLIP_RTS
+// Raise or drop RTS. WR5 is reached by way of WR0, so interrupts are held
+// off in case the BIOS handler selects another register in between.
+void slip_rts(uint8_t on) __naked __z88dk_fastcall {
+  __asm
+    ld a,l
+    or a
+    ld l,SIO_WR5_RTS_OFF
+    jr z,slip_rts_write
+    ld l,SIO_WR5_RTS_ON
+  slip_rts_write:
+    di
+    ld a,SIO_WR5
+    out (SIO_B_CTRL),a
+    ld a,l
+    out (SIO_B_CTRL),a
+    ei
+    ret
+  __endasm;
+}
+#endif
+
+// Tell the gateway whether it's clear to send. Only the RTS line changes
+// here, credit frames carry on regardless. The BIOS interrupt handler drops
+// RTS itself as its ring fills, so the line's state isn't cached.
+void slip_rx_enable(uint8_t on) {
+  #ifdef SLIP_RTS
+  slip_rts(on);
+  #endif
+}
+
+// Drain the serial port, then hand the oldest waiting frame to ip_rx()
+void slip_rx(void) {
+  struct ip_hdr *iph;
+
+  slip_rx_poll();
+
+  if (slip_rx_count == 0) {
+    return;
+  }
+
+  slip_rx_frame = &slip_rx_slots[slip_rx_tail];
+  slip_tx_sent = 0;
+
+  #ifdef SLIP_CSLIP
+  iph = cslip_rx(slip_rx_frame);
+  #else
+  iph = (struct ip_hdr *)slip_rx_frame->data;
+  #endif
+
+  if (iph) {
+    ip_rx(iph);
+  }
+
+  if (++slip_rx_tail == SLIP_RX_SLOTS) {
+    slip_rx_tail = 0;
+  }
+
+  slip_rx_count--;
+
+  // A gateway pacing itself waits for a frame back before it sends anything
+  // else, and a credit frame also hands back whatever was decoded meanwhile
+  if (!slip_tx_sent || slip_rx_bytes != slip_rx_credited) {
+    slip_tx_credit();
+  }
+
+  // A slot is free again
+  slip_rx_enable(1);
+}
+
+// Escape "len" bytes from "in" into a complete frame at "out", returning the
+// frame length. "out" may overlap "in" as long as it starts at least
+// SLIP_TX_HEADROOM bytes earlier, since every byte is read before its
+// escaped form is written.
+uint16_t slip_tx_encode(uint8_t *out, uint8_t *in, uint16_t len) {
+  uint8_t *p = out;
+  uint8_t e;
+
+  *p++ = SLIP_END;
+
+  while (len--) {
+    e = slip_tx_escape[*in];
+
+    if (e) {
+      *p++ = SLIP_ESC;
+      *p++ = e;
+      in++;
+    } else {
+      *p++ = *in++;
     }
   }
+
+  *p++ = SLIP_END;
+
+  return p - out;
 }
 
+#ifdef SLIP_SIO_TX
+// Write a block straight to the SIO, polling for the transmit buffer to empty
+// between bytes.
+void slip_port_write(uint8_t *buffer, uint16_t len) __naked __z88dk_callee {
+  __asm
+    pop bc
+    pop de
+    pop hl
+    push bc
+
+    ld a,d
+    or e
+    ret z
+
+  slip_port_write_wait:
+    in a,(SIO_B_CTRL)
+    and SIO_RR0_TX_EMPTY
+    jr z,slip_port_write_wait
+
+    ld a,(hl)
+    out (SIO_B_DATA),a
+    inc hl
+
+    dec de
+    ld a,d
+    or e
+    jr nz,slip_port_write_wait
+
+    ret
+  __endasm;
+}
+#else
+// Declared callee in slip.h for the SIO version, so this one has to pop its
+// own arguments too
+void slip_port_write(uint8_t *buffer, uint16_t len) __smallc __z88dk_callee {
+  while (len--) {
+    bdos(CPM_WPUN, *buffer++);
+  }
+}
+#endif
+
 void slip_tx(uint8_t *buffer, uint16_t len) {
-  uint16_t i;
+  uint8_t *p = slip_tx_buffer;
+  uint16_t n;
 
   slip_tx_sent = 1;
 
-  bdos(CPM_WPUN, SLIP_END);
+  len = slip_tx_encode(slip_tx_buffer, buffer, len);
 
-  for (i = 0; i < len; i++) {
-    switch (buffer[i]) {
-      case SLIP_END:
-        bdos(CPM_WPUN, SLIP_ESC);
-        bdos(CPM_WPUN, SLIP_ESC_END);
-        break;
+  #ifdef SLIP_BIOS_RING
+  // Receive carries on while a long frame goes out, so keep the BIOS ring
+  // drained between chunks
+  slip_tx_busy = 1;
 
-      case SLIP_ESC:
-        bdos(CPM_WPUN, SLIP_ESC);
-        bdos(CPM_WPUN, SLIP_ESC_ESC);
-        break;
+  while (len) {
+    n = (len > SLIP_TX_CHUNK) ? SLIP_TX_CHUNK : len;
 
-      default:
-        bdos(CPM_WPUN, buffer[i]);
-    }
+    slip_port_write(p, n);
+    slip_rx_poll();
+
+    p += n;
+    len -= n;
   }
 
-  bdos(CPM_WPUN, SLIP_END);
+  slip_tx_busy = 0;
+
+  if (slip_credit_due()) {
+    slip_tx_credit();
+  }
+  #else
+  slip_port_write(p, len);
+  #endif
+}
+
+// Send a credit frame granting the gateway SLIP_CREDIT_WINDOW bytes past
+// what has been drained so far. It's built in its own buffer since it can
+// follow a frame still sitting in slip_tx_buffer.
+void slip_tx_credit(void) {
+  uint8_t credit[4];
+  uint8_t frame[2 + 4 * 2];
+
+  credit[0] = SLIP_CREDIT;
+  credit[1] = slip_rx_bytes >> 8;
+  credit[2] = slip_rx_bytes;
+  credit[3] = SLIP_CREDIT_WINDOW;
+
+  slip_rx_credited = slip_rx_bytes;
+
+  slip_port_write(frame, slip_tx_encode(frame, credit, 4));
 }
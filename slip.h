@@ -9,24 +9,86 @@
 #define SLIP_ESC_END 0xdc
 #define SLIP_ESC_ESC 0xdd
 
-// #define BIOS_RX_BUF 0xFF83
+// Serial receive ring maintained by the BIOS interrupt handler. With
+// SLIP_BIOS_RING defined slip.c drains it directly instead of going
+// through BDOS one byte at a time.
+#define BIOS_RX_BUF 0xFF83
 #define BIOS_RX_BUFUSED 0xFFBE
-// #define BIOS_RX_RDPTR 0xFFBF
-// #define BIOS_RX_BUFSIZE 60
+#define BIOS_RX_RDPTR 0xFFBF
+#define BIOS_RX_BUFSIZE 60
+
+// SIO/2 port B, which the gateway is wired to. With SLIP_SIO_TX defined
+// frames are written to it directly instead of through BDOS.
+#define SIO_B_CTRL 0x82
+#define SIO_B_DATA 0x83
+#define SIO_RR0_TX_EMPTY 0x04
+
+// With SLIP_RTS defined RTS on port B is dropped while every receive slot is
+// full, so a gateway watching it stops sending. The BIOS interrupt handler
+// also drops it as its ring fills, and it's raised again after each drain.
+// WR5 keeps DTR, 8 bit transmit and transmit enable set as the BIOS does.
+#define SIO_WR5 0x05
+#define SIO_WR5_RTS_ON 0xEA
+#define SIO_WR5_RTS_OFF 0xE8
 
 #define SLIP_DECODE_OK 0
 #define SLIP_DECODE_SKIP 1
 #define SLIP_DECODE_DONE 2
 #define SLIP_DECODE_RST 3
 
+#define SLIP_RX_SLOTS 2 // frames that can be held while one is processed
+
+// Credit frames tell the gateway how many bytes have been taken off the
+// serial port so far and how many more it can send on top of that without
+// overrunning the BIOS ring. A new one goes out once half the window has
+// been drained.
+#define SLIP_CREDIT 0x01
+#define SLIP_CREDIT_WINDOW BIOS_RX_BUFSIZE
+#define SLIP_CREDIT_UPDATE (SLIP_CREDIT_WINDOW / 2)
+#define SLIP_TX_CHUNK 32 // bytes written between receive polls
+
+// With SLIP_CSLIP defined TCP/IP headers are compressed (RFC 1144), and each
+// slot has room in front of the frame to expand a compressed header into
+#define SLIP_RX_HEADROOM 60
+
+struct slip_frame {
+  uint16_t len;
+  uint16_t csum; // ones-complement sum of the whole frame
+  uint16_t csum_hdr; // and of just its IP header
+  #ifdef SLIP_CSLIP
+  uint8_t headroom[SLIP_RX_HEADROOM];
+  #endif
+  uint8_t data[SLIP_MTU];
+};
+
 #define slip_buffer_alloc() (calloc(SLIP_MAX, 1))
-#define slip_rx_ready() (*(uint8_t *)BIOS_RX_BUFUSED > 0)
+#define slip_rx_ready() (slip_rx_count > 0 || *(uint8_t *)BIOS_RX_BUFUSED > 0)
+
+// Outgoing packets are built past the headroom so slip_tx() can escape them
+// into the start of the same buffer
+#define SLIP_TX_HEADROOM (SLIP_MAX - SLIP_MTU)
+#define slip_tx_packet() (slip_tx_buffer + SLIP_TX_HEADROOM)
 
 extern uint8_t *slip_rx_buffer;
 extern uint8_t *slip_tx_buffer;
 
+extern struct slip_frame *slip_rx_frame;
+extern uint8_t slip_rx_count;
+extern uint16_t slip_rx_frames;
+extern uint16_t slip_rx_dropped;
+extern uint16_t slip_rx_bytes;
+
 void slip_init(void);
+void slip_reset(void);
+uint8_t slip_rx_decode(uint8_t b);
+void slip_rx_commit(void);
+uint8_t slip_rx_fill(void);
+void slip_rx_poll(void);
+void slip_rx_enable(uint8_t on);
 void slip_rx(void);
+uint16_t slip_tx_encode(uint8_t *out, uint8_t *in, uint16_t len);
+void slip_port_write(uint8_t *buffer, uint16_t len) __smallc __z88dk_callee;
 void slip_tx(uint8_t *buffer, uint16_t len);
+void slip_tx_credit(void);
 
 #endif
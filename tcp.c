@@ -2,16 +2,28 @@
 #include <stdio.h>
 #include <string.h>
 #include "slip.h"
+#include "clock.h"
 #include "ip.h"
 #include "tcp.h"
 
 struct tcp_listener *tcp_listen_table;
 struct tcp_sock *tcp_sock_table;
+struct tcp_sock **tcp_sock_hash;
+struct tcp_held *tcp_held_table;
+struct tcp_sock **tcp_wheel;
 static uint8_t next_conn_id = 0;
+static uint8_t tcp_backlog_count;
+
+uint16_t tcp_clock;
 
 void tcp_init(void) {
   tcp_listen_table = calloc(TCP_MAX_LISTENERS, sizeof(struct tcp_listener));
   tcp_sock_table = calloc(TCP_MAX_SOCKETS, sizeof(struct tcp_sock));
+  tcp_sock_hash = calloc(TCP_SOCK_HASH, sizeof(struct tcp_sock *));
+  tcp_held_table = calloc(TCP_RX_HELD, sizeof(struct tcp_held));
+  tcp_wheel = calloc(TCP_WHEEL_SLOTS, sizeof(struct tcp_sock *));
+
+  tcp_clock = clock_ticks;
 }
 
 void tcp_debug(struct ip_hdr *iph) {
@@ -29,69 +41,182 @@ uint16_t tcp_data_len(struct ip_hdr *iph, struct tcp_hdr *tcph) {
 }
 
 uint8_t tcp_sock_matches_conn_id(struct tcp_sock *s, uint32_t ack_seq) {
-  uint32_t seq_offset = s->local_seq - s->local_isn;
+  uint32_t seq_offset = s->local_una - s->local_isn;
   uint8_t pkt_conn_id = (ack_seq - seq_offset) >> 24;
   return pkt_conn_id == s->conn_id;
 }
 
-void tcp_tick(void) {
+// Called on every pass of the main loop, after clock_poll(), to run the
+// timers for each tick tcp_clock is behind
+void tcp_poll(void) {
+  uint16_t behind = clock_ticks - tcp_clock;
+
+  // After a long stall every slot only needs looking at once
+  if (behind > TCP_WHEEL_SLOTS) {
+    tcp_clock += behind - TCP_WHEEL_SLOTS;
+  }
+
+  while (tcp_clock != clock_ticks) {
+    tcp_clock++;
+    tcp_timer();
+  }
+}
+
+void tcp_timer(void) {
+  struct tcp_sock **p = &tcp_wheel[tcp_clock & (TCP_WHEEL_SLOTS - 1)];
   struct tcp_sock *s;
-  uint8_t i;
 
-  for (i = 0; i < TCP_MAX_SOCKETS; i++) {
-    s = &tcp_sock_table[i];
+  if (tcp_backlog_count) {
+    tcp_backlog_accept();
+  }
+
+  while (*p) {
+    s = *p;
 
-    if (s->state == TCP_CLOSED) {
+    // Due on a later turn of the wheel
+    if (!tcp_due(s->timer_at)) {
+      p = &s->timer_next;
       continue;
     }
 
-    s->ticks++;
+    *p = s->timer_next;
+    tcp_timer_fire(s);
 
-    if (s->ticks > TCP_TIMEOUT_TICKS) {
-      printf("TCP timeout: closing socket %d.%d.%d.%d:%u ticks=%u\n",
-        s->daddr[0], s->daddr[1], s->daddr[2], s->daddr[3], s->dport, s->ticks);
-      tcp_sock_close(s);
-    }
+    // Anything in the slot may have moved, so start over. What's been
+    // fired isn't due again this tick.
+    p = &tcp_wheel[tcp_clock & (TCP_WHEEL_SLOTS - 1)];
   }
 }
 
-uint16_t tcp_checksum(struct ip_hdr *iph, uint8_t *data, uint16_t len) {
-  struct tcp_psuedo_hdr hdr;
-  uint16_t sum;
+// Run whichever of a socket's timers have expired, then put it back in the
+// wheel under the next one
+void tcp_timer_fire(struct tcp_sock *s) {
+  if (tcp_due(s->idle_at)) {
+    printf("TCP timeout: closing socket %d.%d.%d.%d:%u\n",
+      s->daddr[0], s->daddr[1], s->daddr[2], s->daddr[3], s->dport);
+    tcp_sock_close(s);
+    return;
+  }
+
+  if ((s->timers & TCP_TIMER_ACK) && tcp_due(s->ack_at)) {
+    tcp_tx_ack(s);
+  }
 
-  memset(&hdr, 0, sizeof(struct tcp_psuedo_hdr));
+  if ((s->timers & TCP_TIMER_RTX) && tcp_due(s->rtx_at)) {
+    s->timers &= ~TCP_TIMER_RTX;
+    tcp_tx_timeout(s);
+  }
 
-  memcpy(hdr.saddr, iph->saddr, 4);
-  memcpy(hdr.daddr, iph->daddr, 4);
+  if ((s->timers & TCP_TIMER_PERSIST) && tcp_due(s->persist_at) && s->state != TCP_CLOSED) {
+    s->timers &= ~TCP_TIMER_PERSIST;
+    tcp_tx_persist(s);
+  }
 
-  hdr.proto = iph->proto;
-  hdr.len = htons(len);
+  if (s->state != TCP_CLOSED) {
+    tcp_timer_update(s);
+  }
+}
 
-  sum = ~checksum((uint16_t *)&hdr, 12, 0);
+// Make sure "s" comes up in the wheel by "at". Timers that are pushed back
+// or stopped leave it where it is, and it's moved along once it comes up.
+void tcp_timer_at(struct tcp_sock *s, uint16_t at) {
+  if (s->state == TCP_CLOSED || (int16_t)(at - s->timer_at) >= 0) {
+    return;
+  }
 
-  return checksum((uint16_t *)data, len, sum);
+  tcp_wheel_remove(s);
+  s->timer_at = at;
+  tcp_wheel_add(s);
 }
 
-struct tcp_sock *tcp_sock_alloc(void) {
-  struct tcp_sock *s = NULL;
-  struct tcp_sock *cs;
+// Put "s" in the wheel under its earliest running timer
+void tcp_timer_update(struct tcp_sock *s) {
+  uint16_t at = s->idle_at;
+
+  if ((s->timers & TCP_TIMER_RTX) && (int16_t)(s->rtx_at - at) < 0) {
+    at = s->rtx_at;
+  }
+
+  if ((s->timers & TCP_TIMER_ACK) && (int16_t)(s->ack_at - at) < 0) {
+    at = s->ack_at;
+  }
+
+  if ((s->timers & TCP_TIMER_PERSIST) && (int16_t)(s->persist_at - at) < 0) {
+    at = s->persist_at;
+  }
+
+  s->timer_at = at;
+  tcp_wheel_add(s);
+}
+
+void tcp_wheel_add(struct tcp_sock *s) {
+  struct tcp_sock **p = &tcp_wheel[s->timer_at & (TCP_WHEEL_SLOTS - 1)];
+
+  s->timer_next = *p;
+  *p = s;
+}
+
+void tcp_wheel_remove(struct tcp_sock *s) {
+  struct tcp_sock **p = &tcp_wheel[s->timer_at & (TCP_WHEEL_SLOTS - 1)];
+
+  while (*p) {
+    if (*p == s) {
+      *p = s->timer_next;
+      break;
+    }
+
+    p = &(*p)->timer_next;
+  }
+
+  s->timer_next = NULL;
+}
+
+// Push the idle timeout back after hearing from the peer. It's cut short
+// once we're only waiting for the peer's FIN.
+void tcp_idle_reset(struct tcp_sock *s) {
+  s->idle_at = tcp_clock + (s->state == TCP_FIN_WAIT_2 ? TCP_FIN_WAIT_TICKS : TCP_IDLE_TICKS);
+
+  tcp_timer_at(s, s->idle_at);
+}
+
+void tcp_rtx_start(struct tcp_sock *s) {
+  s->timers |= TCP_TIMER_RTX;
+  s->rtx_at = tcp_clock + s->rto;
+
+  tcp_timer_at(s, s->rtx_at);
+}
+
+uint16_t tcp_checksum(struct ip_hdr *iph, uint8_t *data, uint16_t len) {
+  return checksum((uint16_t *)data, len, checksum_pseudo(iph, len));
+}
+
+struct tcp_sock *tcp_sock_free(void) {
   uint8_t i;
 
   for (i = 0; i < TCP_MAX_SOCKETS; i++) {
     if (tcp_sock_table[i].state == TCP_CLOSED) {
-      s = &tcp_sock_table[i];
-      break;
+      return &tcp_sock_table[i];
     }
   }
 
-  // No free socket - evict the oldest one
+  return NULL;
+}
+
+struct tcp_sock *tcp_sock_alloc(void) {
+  struct tcp_sock *s = tcp_sock_free();
+  struct tcp_sock *cs;
+  uint8_t i;
+
+  // No free socket - evict the one nearest to timing out. Only outgoing
+  // connections get here, incoming ones wait in the listener's backlog
+  // instead.
   if (!s) {
     s = &tcp_sock_table[0];
 
     for (i = 1; i < TCP_MAX_SOCKETS; i++) {
       cs = &tcp_sock_table[i];
 
-      if (cs->ticks > s->ticks) {
+      if ((int16_t)(cs->idle_at - s->idle_at) < 0) {
         s = cs;
       }
     }
@@ -99,9 +224,7 @@ struct tcp_sock *tcp_sock_alloc(void) {
 
   // Silently evict the socket if it was in use
   if (s->state != TCP_CLOSED) {
-    if (s->close) {
-      (*(s->close))(s);
-    }
+    tcp_sock_close(s);
   }
 
   memset(s, 0, sizeof(struct tcp_sock));
@@ -116,47 +239,145 @@ struct tcp_sock *tcp_sock_alloc(void) {
 
   // Save the initial sequence number so we can extract the conn_id from response packets
   s->local_isn = s->local_seq;
+  s->local_una = s->local_seq;
+  s->local_max = s->local_seq;
+
+  s->rto = TCP_RTO_INIT;
+  s->mss = TCP_DEFAULT_MSS;
+  s->rx_win = TCP_PACKET_LEN;
+
+  s->idle_at = tcp_clock + TCP_IDLE_TICKS;
+  s->timer_at = s->idle_at;
+  tcp_wheel_add(s);
 
   return s;
 }
 
-struct tcp_sock *tcp_accept(struct ip_hdr *iph) {
-  struct tcp_hdr *tcph = (struct tcp_hdr *)ip_data(iph);
-  struct tcp_listener *l = NULL;
-  struct tcp_sock *s = NULL;
+struct tcp_listener *tcp_listener_get(uint16_t port) {
   uint8_t i;
-  uint16_t dport_host = ntohs(tcph->dport);
-  uint16_t sport_host = ntohs(tcph->sport);
 
   for (i = 0; i < TCP_MAX_LISTENERS; i++) {
-    if (tcp_listen_table[i].port == dport_host) {
-      l = &tcp_listen_table[i];
-      break;
+    if (tcp_listen_table[i].port == port) {
+      return &tcp_listen_table[i];
     }
   }
 
-  if (i == TCP_MAX_LISTENERS) {
-    return NULL;
-  }
+  return NULL;
+}
 
-  s = tcp_sock_alloc();
+// A socket on listener "l" for a SYN from "addr", port "port"
+struct tcp_sock *tcp_sock_new(struct tcp_listener *l, uint8_t *addr, uint16_t port) {
+  struct tcp_sock *s = tcp_sock_alloc();
 
   s->state = TCP_LISTEN;
 
-  s->sport = dport_host;
-  s->dport = sport_host;
+  s->sport = l->port;
+  s->dport = port;
 
   s->open = l->open;
   s->send = l->send;
   s->recv = l->recv;
   s->close = l->close;
 
-  memcpy(s->saddr, iph->daddr, 4);
-  memcpy(s->daddr, iph->saddr, 4);
+  s->listener = l;
+  l->socks++;
+
+  memcpy(s->saddr, local_address, 4);
+  memcpy(s->daddr, addr, 4);
+
+  tcp_sock_template(s);
+  tcp_sock_hash_add(s);
 
   return s;
 }
 
+// Open a socket for a SYN, unless the listener is at its limit or every
+// socket is in use. Then it waits in the backlog rather than pushing out a
+// live connection.
+struct tcp_sock *tcp_accept(struct ip_hdr *iph) {
+  struct tcp_hdr *tcph = (struct tcp_hdr *)ip_data(iph);
+  struct tcp_listener *l = tcp_listener_get(ntohs(tcph->dport));
+
+  if (!l) {
+    return NULL;
+  }
+
+  if ((l->max_socks && l->socks >= l->max_socks) || !tcp_sock_free()) {
+    tcp_backlog_add(l, iph);
+    return NULL;
+  }
+
+  return tcp_sock_new(l, iph->saddr, ntohs(tcph->sport));
+}
+
+// Remember a SYN that can't be answered yet. The peer repeats it until it
+// is, which keeps the entry fresh. If the backlog is full it's dropped.
+void tcp_backlog_add(struct tcp_listener *l, struct ip_hdr *iph) {
+  struct tcp_hdr *tcph = (struct tcp_hdr *)ip_data(iph);
+  struct tcp_pending *p;
+  uint16_t port = ntohs(tcph->sport);
+  uint8_t i;
+
+  for (i = 0; i < l->backlog_len; i++) {
+    p = &l->backlog[i];
+
+    if (p->port == port && !memcmp(p->addr, iph->saddr, 4)) {
+      break;
+    }
+  }
+
+  if (i == l->backlog_len) {
+    if (l->backlog_len == TCP_BACKLOG) {
+      return;
+    }
+
+    l->backlog_len++;
+    tcp_backlog_count++;
+  }
+
+  p = &l->backlog[i];
+
+  memcpy(p->addr, iph->saddr, 4);
+  p->port = port;
+  p->seq = ntohl(tcph->seq);
+  p->mss = tcp_rx_mss(tcph);
+  p->clock = tcp_clock;
+}
+
+// Answer queued SYNs, oldest first, as sockets and listener capacity free up
+void tcp_backlog_accept(void) {
+  struct tcp_listener *l;
+  struct tcp_pending *p;
+  struct tcp_sock *s;
+  uint8_t i;
+
+  for (i = 0; i < TCP_MAX_LISTENERS; i++) {
+    l = &tcp_listen_table[i];
+
+    while (l->backlog_len > 0) {
+      p = &l->backlog[0];
+
+      if ((uint16_t)(tcp_clock - p->clock) <= TCP_BACKLOG_TIMEOUT) {
+        if (l->max_socks && l->socks >= l->max_socks) {
+          break;
+        }
+
+        if (!tcp_sock_free()) {
+          return;
+        }
+
+        s = tcp_sock_new(l, p->addr, p->port);
+        tcp_rx_syn(s, p->seq, p->mss);
+      }
+
+      l->backlog_len--;
+      tcp_backlog_count--;
+
+      memmove(p, p + 1, l->backlog_len * sizeof(struct tcp_pending));
+    }
+  }
+}
+
 struct tcp_sock *tcp_connect(
   uint8_t *addr,
   uint16_t port,
@@ -186,28 +407,43 @@ struct tcp_sock *tcp_connect(
   memcpy(s->saddr, local_address, 4);
   memcpy(s->daddr, addr, 4);
 
+  tcp_sock_template(s);
+  tcp_sock_hash_add(s);
+
   tcp_tx_syn(s);
 
   s->local_seq++;
 
+  tcp_tx_sent(s, s->local_isn);
+
   return s;
 }
 
+// Build the headers every segment on "s" starts from, once its addresses and
+// ports are known
+void tcp_sock_template(struct tcp_sock *s) {
+  struct ip_hdr *iph = &s->tmpl.ip;
+  struct tcp_hdr *tcph = &s->tmpl.tcp;
+
+  ip_hdr_template(iph, s->daddr, TCP);
+
+  memset(tcph, 0, sizeof(struct tcp_hdr));
+
+  tcph->sport = htons(s->sport);
+  tcph->dport = htons(s->dport);
+  tcph->offset = 5;
+
+  tcph->csum = checksum_add(checksum_pseudo(iph, 0), ~checksum((uint16_t *)tcph, 4, 0));
+}
+
 struct tcp_sock *tcp_sock_get(struct ip_hdr *iph) {
   struct tcp_hdr *tcph = (struct tcp_hdr *)ip_data(iph);
   struct tcp_sock *s;
-  uint8_t i;
   uint16_t sport_host = ntohs(tcph->sport);
   uint16_t dport_host = ntohs(tcph->dport);
   uint32_t ack_seq_host = ntohl(tcph->ack_seq);
 
-  for (i = 0; i < TCP_MAX_SOCKETS; i++) {
-    s = &tcp_sock_table[i];
-
-    if (s->state == TCP_CLOSED) {
-      continue;
-    }
-
+  for (s = tcp_sock_hash[tcp_hash(iph->saddr, sport_host, dport_host)]; s; s = s->hash_next) {
     if (s->sport != dport_host) {
       continue;
     }
@@ -237,11 +473,62 @@ struct tcp_sock *tcp_sock_get(struct ip_hdr *iph) {
   return NULL;
 }
 
+// Sockets are found by tcp_sock_get() from the time their ports and
+// addresses are set until they're closed
+void tcp_sock_hash_add(struct tcp_sock *s) {
+  struct tcp_sock **bucket = &tcp_sock_hash[tcp_hash(s->daddr, s->dport, s->sport)];
+
+  s->hash_next = *bucket;
+  *bucket = s;
+}
+
+void tcp_sock_hash_remove(struct tcp_sock *s) {
+  struct tcp_sock **p = &tcp_sock_hash[tcp_hash(s->daddr, s->dport, s->sport)];
+
+  while (*p) {
+    if (*p == s) {
+      *p = s->hash_next;
+      break;
+    }
+
+    p = &(*p)->hash_next;
+  }
+
+  s->hash_next = NULL;
+}
+
 void tcp_sock_close(struct tcp_sock *s) {
   s->state = TCP_CLOSED;
 
-  if (s->close) {
-    (*s->close)(s);
+  // Anything corked goes with it, so tcp_tx_more can't flush it after a RST
+  s->tx_pending = 0;
+
+  tcp_sock_hash_remove(s);
+  tcp_wheel_remove(s);
+
+  tcp_rx_held_free(s);
+
+  tcp_sock_detach(s);
+}
+
+// Tell the application it's done with "s". Once our FIN is sent the
+// application stays attached until it's acknowledged, so that anything lost
+// on the way can be asked for again.
+void tcp_sock_detach(struct tcp_sock *s) {
+  void (*close)(struct tcp_sock *) = s->close;
+
+  if (s->listener) {
+    s->listener->socks--;
+    s->listener = NULL;
+  }
+
+  s->open = NULL;
+  s->recv = NULL;
+  s->send = NULL;
+  s->close = NULL;
+
+  if (close) {
+    (*close)(s);
   }
 }
 
@@ -251,11 +538,12 @@ void tcp_rx(struct ip_hdr *iph) {
   uint16_t tcp_len = ip_data_len(iph);
   uint16_t tcpd_len = tcp_data_len(iph, tcph);
   struct tcp_sock *s;
+  struct tcp_held *h;
   uint16_t csum;
+  uint32_t seq;
+  uint8_t acked = 0;
 
-  tcp_tick();
-
-  csum = tcp_checksum(iph, (uint8_t *)tcph, tcp_len);
+  csum = ip_rx_data_checksum(iph, tcp_len, checksum_pseudo(iph, tcp_len));
   if (csum != 0) {
     return;
   }
@@ -278,37 +566,79 @@ void tcp_rx(struct ip_hdr *iph) {
     return;
   }
 
-  // No socket, reject with RST
+  // No socket, reject with RST. A SYN for a listener that's busy has been
+  // queued instead.
   if (!s) {
-    tcp_reject(iph);
+    if (!(tcph->flags & TCP_SYN) || !tcp_listener_get(tcph->dport)) {
+      tcp_reject(iph);
+    }
     return;
   }
 
-  s->ticks = 0;
+  // A peer that keeps its window shut doesn't keep the connection alive by
+  // answering probes, so a reader that has stalled gives up its socket
+  if (!(s->timers & TCP_TIMER_PERSIST) || tcph->win > 0) {
+    tcp_idle_reset(s);
+  }
 
   if (s->state != TCP_LISTEN && s->state != TCP_SYN_SENT) {
-    // Retransmission - already processed, drop silently
-    if (tcph->seq < s->remote_seq) {
-      return;
+    if (tcph->flags & TCP_ACK) {
+      acked = tcp_rx_ack(s, tcph, tcpd_len);
+    }
+
+    seq = s->remote_seq - tcph->seq;
+
+    // Starts with data we've already had
+    if ((int32_t)seq > 0) {
+      // A retransmission, so our ACK must have been lost, or a probe of our
+      // window that wants one back (RFC 793)
+      if (seq > tcpd_len || (seq == tcpd_len && !(tcph->flags & TCP_FIN))) {
+        // The peer's SYN again, so it's our SYN-ACK that was lost
+        if (s->state == TCP_SYN_RCVD && (tcph->flags & TCP_SYN) && seq == 1) {
+          tcp_tx_resend(s);
+          return;
+        }
+
+        tcp_tx_ack(s);
+        tcp_rx_acked(s, acked);
+        return;
+      }
+
+      tcpd += seq;
+      tcpd_len -= seq;
+      tcph->seq = s->remote_seq;
     }
 
-    // Out of order packet
+    // Out of order. Hold on to it if there's room, and send a duplicate ACK
+    // so the peer knows what's missing.
     if (tcph->seq != s->remote_seq) {
-      tcp_tx_rst(s);
-      tcp_sock_close(s);
+      if (s->state == TCP_ESTABLISHED) {
+        tcp_rx_hold(s, tcph, tcpd, tcpd_len);
+      }
+
+      tcp_tx_ack(s);
+      tcp_rx_acked(s, acked);
       return;
     }
+
+    // Past the window we advertised. What's cut off is sent again once the
+    // application has room for it.
+    if (tcpd_len > s->rx_win) {
+      tcph->flags &= ~TCP_FIN;
+      tcpd_len = s->rx_win;
+
+      if (tcpd_len == 0) {
+        tcp_tx_ack(s);
+        tcp_rx_acked(s, acked);
+        return;
+      }
+    }
   }
 
   switch (s->state) {
     case TCP_LISTEN:
       if (tcph->flags & TCP_SYN) {
-        s->remote_seq = tcph->seq + 1;
-
-        tcp_tx_synack(s);
-
-        s->local_seq++;
-        s->state = TCP_SYN_RCVD;
+        tcp_rx_syn(s, tcph->seq, tcp_rx_mss(tcph));
       }
       break;
 
@@ -326,69 +656,58 @@ void tcp_rx(struct ip_hdr *iph) {
       if (tcph->flags & (TCP_SYN|TCP_ACK)) {
         s->remote_seq = tcph->seq + 1;
 
-        tcp_tx_ack(s);
+        s->mss = tcp_rx_mss(tcph);
+        tcp_rx_ack(s, tcph, 0);
 
-        s->local_seq++;
         s->state = TCP_ESTABLISHED;
 
         if (s->open) {
           (*s->open)(s);
         }
-      }
-      break;
-
-    case TCP_ESTABLISHED:
-      s->remote_seq += tcpd_len;
-
-      if (tcph->flags & TCP_FIN) {
-        s->remote_seq++;
-
-        if (tcpd_len > 0 && s->recv) {
-          (*s->recv)(s, tcpd, tcpd_len);
-        }
-
-        tcp_tx_fin(s);
 
-        s->local_seq++;
-        s->state = TCP_LAST_ACK;
+        // The handshake completes on the first data if the application has
+        // any ready, otherwise on a bare ACK
+        seq = s->local_seq;
 
-        if (s->close) {
-          (*s->close)(s);
-        }
-      } else if (tcpd_len > 0) {
-        if (s->recv) {
-          (*s->recv)(s, tcpd, tcpd_len);
-        }
+        tcp_tx_more(s);
 
-        if (s->send) {
-          (*s->send)(s, tcph->win);
-        } else {
+        if (s->local_seq == seq && s->state == TCP_ESTABLISHED) {
           tcp_tx_ack(s);
         }
-      } else if (tcph->flags & TCP_ACK) {
-        if (s->send) {
-          (*s->send)(s, tcph->win);
-        }
       }
       break;
 
+    case TCP_ESTABLISHED:
+      tcp_rx_data(s, tcpd, tcpd_len, tcph->flags);
+      break;
+
+    case TCP_CLOSE_WAIT:
+      tcp_tx_more(s);
+      break;
+
+    // Segments sent before our FIN can still be in flight, so these states
+    // only move on once everything up to and including the FIN is acknowledged
     case TCP_LAST_ACK:
-      if (tcph->flags & TCP_ACK) {
+      if (s->local_una == s->local_max) {
         tcp_sock_close(s);
       }
       break;
 
     case TCP_FIN_WAIT_1:
-      if (tcph->flags & TCP_FIN && tcph->flags & TCP_ACK) {
+      if (tcph->flags & TCP_FIN && s->local_una == s->local_max) {
         s->remote_seq++;
         tcp_tx_ack(s);
-        s->state = TCP_CLOSED;
+        tcp_sock_close(s);
       } else if (tcph->flags & TCP_FIN) {
         s->remote_seq++;
         tcp_tx_ack(s);
         s->state = TCP_CLOSING;
-      } else if (tcph->flags & TCP_ACK) {
+      } else if (s->local_una == s->local_max) {
         s->state = TCP_FIN_WAIT_2;
+        tcp_idle_reset(s);
+        tcp_sock_detach(s);
+      } else {
+        tcp_tx_more(s);
       }
       break;
 
@@ -401,96 +720,707 @@ void tcp_rx(struct ip_hdr *iph) {
       break;
 
     case TCP_CLOSING:
-      if (tcph->flags & TCP_ACK) {
+      if (s->local_una == s->local_max) {
         tcp_sock_close(s);
       }
       break;
   }
-}
-
-struct ip_hdr *tcp_packet_init(struct tcp_sock *s) {
-  struct ip_hdr *iph = ip_hdr_init();
-  struct tcp_hdr *tcph = (struct tcp_hdr *)ip_data(iph);
 
-  iph->len = 20 + 20;
-  iph->proto = TCP;
+  // Segments that arrived early may follow on now, as far as the window
+  // the application has left takes them. The peer sends the rest again.
+  while (s->state == TCP_ESTABLISHED && s->rx_win > 0 && (h = tcp_rx_held_next(s))) {
+    seq = s->remote_seq - h->seq;
+    tcpd_len = h->len - seq;
 
-  tcph->sport = s->sport;
-  tcph->dport = s->dport;
-  tcph->seq = s->local_seq;
-  tcph->ack_seq = s->remote_seq;
-  tcph->offset = 5;
-  tcph->win = TCP_PACKET_LEN;
+    if (tcpd_len > s->rx_win) {
+      tcpd_len = s->rx_win;
+      h->flags = 0;
+    }
 
-  memcpy(iph->daddr, s->daddr, 4);
+    tcp_rx_data(s, h->data + seq, tcpd_len, h->flags);
 
-  return iph;
+    h->s = NULL;
+  }
 }
 
-void tcp_tx(struct ip_hdr *iph) {
-  struct tcp_hdr *tcph = (struct tcp_hdr *)ip_data(iph);
-  uint16_t tcp_len = ip_data_len(iph);
+// Answer a SYN with sequence number "seq" from a peer that takes segments
+// of up to "mss" bytes
+void tcp_rx_syn(struct tcp_sock *s, uint32_t seq, uint16_t mss) {
+  s->remote_seq = seq + 1;
+  s->mss = mss;
 
-  tcph->sport = htons(tcph->sport);
-  tcph->dport = htons(tcph->dport);
-  tcph->seq = htonl(tcph->seq);
-  tcph->ack_seq = htonl(tcph->ack_seq);
-  tcph->win = htons(tcph->win);
-  tcph->urp = htons(tcph->urp);
+  tcp_tx_synack(s);
 
-  tcph->csum = tcp_checksum(iph, (uint8_t *)tcph, tcp_len);
+  s->local_seq++;
+  s->state = TCP_SYN_RCVD;
 
-  ip_tx(iph);
+  tcp_tx_sent(s, s->local_isn);
 }
 
-void tcp_tx_data(struct tcp_sock *s, uint8_t *data, uint16_t len) {
-  struct ip_hdr *iph = tcp_packet_init(s);
-  struct tcp_hdr *tcph = (struct tcp_hdr *)ip_data(iph);
-  uint8_t *tcpd = tcp_data(tcph);
+// Pick the peer's MSS out of the options on its SYN, keeping to what fits
+// our own link. Without one the peer is taken to want TCP_DEFAULT_MSS.
+uint16_t tcp_rx_mss(struct tcp_hdr *tcph) {
+  uint8_t *opt = (uint8_t *)(tcph + 1);
+  uint8_t *end = tcp_data(tcph);
+  uint16_t mss = TCP_DEFAULT_MSS;
 
-  iph->len = iph->len + len;
+  while (opt < end && *opt != TCP_OPT_END) {
+    if (*opt == TCP_OPT_NOP) {
+      opt++;
+      continue;
+    }
 
-  tcph->flags |= TCP_ACK;
-  tcph->flags |= TCP_PSH;
+    if (opt + 2 > end || opt[1] < 2 || opt + opt[1] > end) {
+      break;
+    }
 
-  memcpy(tcpd, data, len);
+    if (opt[0] == TCP_OPT_MSS && opt[1] == 4 && (opt[2] || opt[3])) {
+      mss = (opt[2] << 8) | opt[3];
+    }
 
-  s->local_seq += len;
+    opt += opt[1];
+  }
 
-  tcp_tx(iph);
+  return mss < TCP_PACKET_LEN ? mss : TCP_PACKET_LEN;
 }
 
-void tcp_tx_data_fin(struct tcp_sock *s, uint8_t *data, uint16_t len) {
-  struct ip_hdr *iph = tcp_packet_init(s);
-  struct tcp_hdr *tcph = (struct tcp_hdr *)ip_data(iph);
-  uint8_t *tcpd = tcp_data(tcph);
+// Hand in-order data to the application while established
+void tcp_rx_data(struct tcp_sock *s, uint8_t *data, uint16_t len, uint8_t flags) {
+  uint32_t seq;
+  uint16_t win = s->rx_win;
 
-  iph->len = iph->len + len;
+  s->remote_seq += len;
 
-  tcph->flags |= TCP_ACK;
-  tcph->flags |= TCP_PSH;
-  tcph->flags |= TCP_FIN;
+  if (flags & TCP_FIN) {
+    s->remote_seq++;
 
-  memcpy(tcpd, data, len);
+    if (len > 0 && s->recv) {
+      (*s->recv)(s, data, len);
+    }
+
+    // Part way through sending segments again, the application has to
+    // stay to finish them, and our FIN goes after
+    if (s->local_seq != s->local_max) {
+      s->state = TCP_CLOSE_WAIT;
+      seq = s->local_seq;
+
+      tcp_tx_more(s);
+
+      if (s->local_seq == seq) {
+        tcp_tx_ack(s);
+      }
+    } else {
+      tcp_tx_fin_last(s);
+    }
+  } else if (len > 0) {
+    if (s->recv) {
+      (*s->recv)(s, data, len);
+    }
+
+    // The reply carries the ACK if there is one
+    seq = s->local_seq;
+
+    tcp_tx_more(s);
+
+    // A peer that has filled our window can't send again until it hears
+    // how much the application took, so that isn't held back
+    if (s->local_seq == seq && s->state == TCP_ESTABLISHED) {
+      if (len >= win) {
+        tcp_tx_ack(s);
+      } else {
+        tcp_tx_ack_later(s);
+      }
+    }
+  } else if (flags & TCP_ACK) {
+    tcp_tx_more(s);
+  }
+}
+
+// Keep a copy of a segment that arrived ahead of the one expected. If every
+// slot is taken it's dropped, and the peer sends it again later.
+void tcp_rx_hold(struct tcp_sock *s, struct tcp_hdr *tcph, uint8_t *data, uint16_t len) {
+  struct tcp_held *h;
+  struct tcp_held *slot = NULL;
+  uint32_t ahead = tcph->seq - s->remote_seq;
+  uint8_t flags = tcph->flags & TCP_FIN;
+  uint8_t i;
+
+  // Nothing past the window we advertised is kept, as it's acknowledged
+  // once the gap is filled
+  if (ahead >= s->rx_win) {
+    return;
+  }
+
+  if (len > s->rx_win - ahead) {
+    len = s->rx_win - ahead;
+    flags = 0;
+  }
+
+  if (len > TCP_PACKET_LEN || (len == 0 && !flags)) {
+    return;
+  }
+
+  for (i = 0; i < TCP_RX_HELD; i++) {
+    h = &tcp_held_table[i];
+
+    if (!h->s) {
+      slot = h;
+    } else if (h->s == s && h->seq == tcph->seq) {
+      return;
+    }
+  }
+
+  if (!slot) {
+    return;
+  }
+
+  slot->s = s;
+  slot->seq = tcph->seq;
+  slot->len = len;
+  slot->flags = flags;
+
+  memcpy(slot->data, data, len);
+}
+
+// The held segment on "s" that now continues the stream, if any. Ones that
+// turn out to be wholly covered by data since received are let go.
+struct tcp_held *tcp_rx_held_next(struct tcp_sock *s) {
+  struct tcp_held *h;
+  uint32_t seq;
+  uint8_t i;
+
+  for (i = 0; i < TCP_RX_HELD; i++) {
+    h = &tcp_held_table[i];
+
+    if (h->s != s) {
+      continue;
+    }
+
+    seq = s->remote_seq - h->seq;
+
+    if ((int32_t)seq < 0) {
+      continue;
+    }
+
+    if (seq < h->len || (seq == h->len && h->flags & TCP_FIN)) {
+      return h;
+    }
+
+    h->s = NULL;
+  }
+
+  return NULL;
+}
+
+void tcp_rx_held_free(struct tcp_sock *s) {
+  uint8_t i;
+
+  for (i = 0; i < TCP_RX_HELD; i++) {
+    if (tcp_held_table[i].s == s) {
+      tcp_held_table[i].s = NULL;
+    }
+  }
+}
+
+// Slide the send window up to an acknowledgement from the peer. ACKs for
+// data that was never sent, or that is already acknowledged, are ignored.
+// Returns 1 if the ACK moved or resized the peer's window
+uint8_t tcp_rx_ack(struct tcp_sock *s, struct tcp_hdr *tcph, uint16_t len) {
+  uint32_t seq;
+
+  if ((int32_t)(tcph->ack_seq - s->local_una) < 0) {
+    return 0;
+  }
+
+  if ((int32_t)(tcph->ack_seq - s->local_max) > 0) {
+    return 0;
+  }
+
+  if (tcph->ack_seq == s->local_una) {
+    // A bare ACK that neither moves nor resizes the window means a segment
+    // after the first unacknowledged one arrived. Enough of them in a row
+    // and the first one is taken to be lost.
+    if (len == 0 && tcph->win == s->remote_win && s->local_una != s->local_max) {
+      if (++s->dup_acks == TCP_DUP_ACKS) {
+        seq = s->local_seq;
+
+        tcp_tx_resend(s);
+
+        if ((int32_t)(seq - s->local_seq) > 0) {
+          s->local_seq = seq;
+        }
+      }
+    }
+
+    if (tcph->win == s->remote_win) {
+      return 0;
+    }
+
+    // The window has opened again. Probing backed off the RTO, which
+    // shouldn't carry over to retransmissions.
+    if (s->remote_win == 0) {
+      tcp_rto_reset(s);
+    }
+
+    s->remote_win = tcph->win;
+    return 1;
+  }
+
+  s->local_una = tcph->ack_seq;
+  s->remote_win = tcph->win;
+  s->dup_acks = 0;
+  s->retries = 0;
+
+  // The original of a segment being resent got through after all
+  if ((int32_t)(s->local_una - s->local_seq) > 0) {
+    s->local_seq = s->local_una;
+  }
+
+  if (s->rtt_timing && (int32_t)(s->local_una - s->rtt_seq) > 0) {
+    s->rtt_timing = 0;
+    tcp_rtt_sample(s, tcp_clock - s->rtt_start);
+  }
+
+  tcp_rto_reset(s);
+
+  if (s->local_una == s->local_max) {
+    s->timers &= ~TCP_TIMER_RTX;
+  } else {
+    tcp_rtx_start(s);
+  }
+
+  return 1;
+}
+
+// An ACK on a segment that had nothing new in it still counts. Finish
+// closing if it covers our FIN, or send whatever it made room for.
+void tcp_rx_acked(struct tcp_sock *s, uint8_t acked) {
+  if (s->local_una == s->local_max) {
+    switch (s->state) {
+      case TCP_FIN_WAIT_1:
+        s->state = TCP_FIN_WAIT_2;
+        tcp_idle_reset(s);
+        tcp_sock_detach(s);
+        return;
+
+      case TCP_CLOSING:
+      case TCP_LAST_ACK:
+        tcp_sock_close(s);
+        return;
+    }
+  }
+
+  if (acked) {
+    tcp_tx_more(s);
+  }
+}
+
+// Fold a round trip time into the smoothed estimate and its variation, as
+// in Jacobson and Karels' "Congestion Avoidance and Control"
+void tcp_rtt_sample(struct tcp_sock *s, uint16_t rtt) {
+  int16_t delta;
+
+  if (rtt == 0) {
+    rtt = 1;
+  } else if (rtt > TCP_RTO_MAX) {
+    rtt = TCP_RTO_MAX;
+  }
+
+  if (s->srtt == 0) {
+    s->srtt = rtt << 3;
+    s->rttvar = rtt << 1;
+    return;
+  }
+
+  delta = rtt - (s->srtt >> 3);
+  s->srtt += delta;
+
+  if (delta < 0) {
+    delta = -delta;
+  }
+
+  s->rttvar += delta - (s->rttvar >> 2);
+}
+
+// Set the retransmission timeout from the RTT estimate, dropping any backoff
+void tcp_rto_reset(struct tcp_sock *s) {
+  if (s->srtt == 0) {
+    s->rto = TCP_RTO_INIT;
+    return;
+  }
+
+  s->rto = (s->srtt >> 3) + s->rttvar;
+
+  if (s->rto < TCP_RTO_MIN) {
+    s->rto = TCP_RTO_MIN;
+  } else if (s->rto > TCP_RTO_MAX) {
+    s->rto = TCP_RTO_MAX;
+  }
+}
+
+void tcp_rto_backoff(struct tcp_sock *s) {
+  if (s->rto < TCP_RTO_MAX / 2) {
+    s->rto <<= 1;
+  } else {
+    s->rto = TCP_RTO_MAX;
+  }
+}
+
+// Bytes that can be sent on "s" before the peer's window or TCP_TX_WINDOW
+// is full
+uint16_t tcp_tx_window(struct tcp_sock *s) {
+  uint16_t win = s->remote_win < TCP_TX_WINDOW ? s->remote_win : TCP_TX_WINDOW;
+  uint16_t in_flight = s->local_seq - s->local_una;
+
+  if (in_flight >= win) {
+    return 0;
+  }
+
+  win -= in_flight;
+
+  if (s->state == TCP_CLOSE_WAIT && win > s->local_max - s->local_seq) {
+    win = s->local_max - s->local_seq;
+  }
+
+  return win;
+}
+
+// Keep asking the application for segments while the window has room. A
+// short segment is only asked for once everything before it is acknowledged,
+// so an almost full window isn't filled with runts.
+void tcp_tx_more(struct tcp_sock *s) {
+  uint16_t win;
+  uint32_t seq;
+
+  if (!s->send) {
+    return;
+  }
+
+  while (1) {
+    // After our FIN only segments lost on the way are asked for again, and
+    // after the peer's only those it was sent before
+    if (s->state == TCP_CLOSE_WAIT) {
+      if (s->local_seq == s->local_max) {
+        break;
+      }
+    } else if (s->state != TCP_ESTABLISHED) {
+      if (s->state != TCP_FIN_WAIT_1 || !tcp_tx_data_lost(s)) {
+        break;
+      }
+    }
+
+    win = tcp_tx_window(s);
+
+    if (win == 0) {
+      break;
+    }
+
+    if (win < s->mss && s->local_seq != s->local_una) {
+      break;
+    }
+
+    seq = s->local_seq;
+
+    (*s->send)(s, win);
+    tcp_tx_flush(s);
+
+    // Nothing more to send for now
+    if (s->local_seq == seq) {
+      break;
+    }
+  }
+
+  if (s->state == TCP_CLOSE_WAIT && s->local_seq == s->local_max) {
+    tcp_tx_fin_last(s);
+    return;
+  }
+
+  // With nothing in flight no ACK is coming to say the window has opened
+  // again, so the persist timer has to go and ask
+  if (!(s->timers & TCP_TIMER_PERSIST) && tcp_tx_stalled(s)) {
+    s->timers |= TCP_TIMER_PERSIST;
+    s->persist_at = tcp_clock + s->rto;
+
+    tcp_timer_at(s, s->persist_at);
+  }
+}
+
+// True when the peer's window is shut and everything sent has been
+// acknowledged
+uint8_t tcp_tx_stalled(struct tcp_sock *s) {
+  return s->state == TCP_ESTABLISHED && s->send && s->remote_win == 0 && s->local_una == s->local_max;
+}
+
+// The persist timer ran out. Probe the peer if its window is still shut,
+// backing off between probes as for retransmissions, but never giving up.
+void tcp_tx_persist(struct tcp_sock *s) {
+  if (!tcp_tx_stalled(s)) {
+    return;
+  }
+
+  tcp_tx_probe(s);
+  tcp_rto_backoff(s);
+
+  s->timers |= TCP_TIMER_PERSIST;
+  s->persist_at = tcp_clock + s->rto;
+}
+
+// True when data between local_seq and the FIN that followed it has to be
+// sent again, rather than just the FIN
+uint8_t tcp_tx_data_lost(struct tcp_sock *s) {
+  return (int32_t)(s->local_max - s->local_seq) > 1;
+}
+
+// Account for a segment that covered "seq" up to local_seq. New data is
+// timed for the RTT estimate, unless a segment is already being timed, and
+// the retransmission timer is started if it isn't running.
+void tcp_tx_sent(struct tcp_sock *s, uint32_t seq) {
+  if ((int32_t)(seq - s->local_max) >= 0 && !s->rtt_timing) {
+    s->rtt_timing = 1;
+    s->rtt_seq = seq;
+    s->rtt_start = tcp_clock;
+  }
+
+  if ((int32_t)(s->local_seq - s->local_max) > 0) {
+    s->local_max = s->local_seq;
+  }
+
+  if (!(s->timers & TCP_TIMER_RTX)) {
+    tcp_rtx_start(s);
+  }
+}
+
+// Send the oldest unacknowledged segment again, leaving local_seq after it.
+// Data isn't kept once it's sent, so the application is asked for it again
+// from local_una.
+void tcp_tx_resend(struct tcp_sock *s) {
+  uint32_t seq = s->local_seq;
+
+  // Karn's algorithm: a segment that's been sent twice can't be timed
+  s->rtt_timing = 0;
+
+  s->local_seq = s->local_una;
+
+  switch (s->state) {
+    case TCP_SYN_SENT:
+      tcp_tx_syn(s);
+      s->local_seq = seq;
+      break;
+
+    case TCP_SYN_RCVD:
+      tcp_tx_synack(s);
+      s->local_seq = seq;
+      break;
+
+    default:
+      if (s->state != TCP_ESTABLISHED && s->state != TCP_CLOSE_WAIT && !tcp_tx_data_lost(s)) {
+        // Only our FIN is outstanding
+        s->local_seq = s->local_max - 1;
+        tcp_tx_fin(s);
+        s->local_seq = seq;
+        break;
+      }
+
+      if (s->send && tcp_tx_window(s) > 0) {
+        (*s->send)(s, tcp_tx_window(s));
+        tcp_tx_flush(s);
+      }
+
+      // The application had nothing to send again
+      if (s->local_seq == s->local_una) {
+        s->local_seq = seq;
+      }
+      break;
+  }
+}
+
+// The retransmission timer ran out: back off, then go back to the oldest
+// unacknowledged segment and send everything from there again
+void tcp_tx_timeout(struct tcp_sock *s) {
+  if (++s->retries > TCP_MAX_RETRIES) {
+    printf("TCP retransmit: giving up on %d.%d.%d.%d:%u\n",
+      s->daddr[0], s->daddr[1], s->daddr[2], s->daddr[3], s->dport);
+    tcp_tx_rst(s);
+    tcp_sock_close(s);
+    return;
+  }
+
+  tcp_rto_backoff(s);
+
+  s->dup_acks = 0;
+
+  tcp_tx_resend(s);
+  tcp_tx_more(s);
+
+  tcp_rtx_start(s);
+}
+
+// Tell TCP how much more the application on "s" has room for. It goes out
+// as our window from the next segment on, and if the window was shut the
+// peer is told straight away that it has opened.
+void tcp_rx_window(struct tcp_sock *s, uint16_t space) {
+  uint16_t win = space < TCP_PACKET_LEN ? space : TCP_PACKET_LEN;
+  uint16_t was = s->rx_win;
+
+  s->rx_win = win;
+
+  if (was == 0 && win > 0 && s->state == TCP_ESTABLISHED) {
+    tcp_tx_ack(s);
+  }
+}
+
+// Bytes of the stream sent on "s" before the next segment. Applications use
+// it to find their place again when segments are resent.
+uint32_t tcp_tx_offset(struct tcp_sock *s) {
+  return s->local_seq - s->local_isn - 1;
+}
+
+// True once everything sent on "s" has been acknowledged
+uint8_t tcp_tx_acked(struct tcp_sock *s) {
+  return s->local_una == s->local_max;
+}
+
+struct ip_hdr *tcp_packet_init(struct tcp_sock *s) {
+  struct ip_hdr *iph = (struct ip_hdr *)slip_tx_packet();
+  struct tcp_hdr *tcph = (struct tcp_hdr *)(iph + 1);
+
+  memcpy(iph, &s->tmpl, sizeof(struct tcp_template));
+
+  // Every segment acknowledges everything received so far
+  s->ack_pending = 0;
+  s->timers &= ~TCP_TIMER_ACK;
+
+  iph->len = 20 + 20;
+
+  tcph->seq = s->local_seq;
+  tcph->ack_seq = s->remote_seq;
+  tcph->win = s->rx_win;
+
+  return iph;
+}
+
+// Expects the ports in network byte order and everything else in host order
+void tcp_tx(struct ip_hdr *iph) {
+  struct tcp_hdr *tcph = (struct tcp_hdr *)ip_data(iph);
+  uint16_t tcp_len = ip_data_len(iph);
+  uint16_t sum;
+
+  tcph->seq = htonl(tcph->seq);
+  tcph->ack_seq = htonl(tcph->ack_seq);
+  tcph->win = htons(tcph->win);
+  tcph->urp = htons(tcph->urp);
+
+  if (tcph->csum) {
+    // Built from a socket template, so the ports and addresses are already summed
+    sum = checksum_add(tcph->csum, htons(tcp_len));
+    tcph->csum = 0;
+    tcph->csum = checksum((uint16_t *)&tcph->seq, tcp_len - 4, sum);
+  } else {
+    tcph->csum = tcp_checksum(iph, (uint8_t *)tcph, tcp_len);
+  }
+
+  ip_tx(iph);
+}
+
+// Where the payload of the next segment sent on "s" goes, after anything
+// corked with tcp_tx_data_more(). Data written here before calling one of
+// the tcp_tx_data functions is sent without being copied.
+uint8_t *tcp_tx_payload(struct tcp_sock *s) {
+  return slip_tx_packet() + 20 + 20 + s->tx_pending;
+}
+
+// Most payload bytes that still fit in the next segment sent on "s"
+uint16_t tcp_tx_space(struct tcp_sock *s) {
+  return s->mss - s->tx_pending;
+}
+
+// Send "len" bytes from "data" after whatever is corked on "s"
+void tcp_tx_segment(struct tcp_sock *s, uint8_t *data, uint16_t len, uint8_t flags) {
+  struct ip_hdr *iph = tcp_packet_init(s);
+  struct tcp_hdr *tcph = (struct tcp_hdr *)ip_data(iph);
+  uint8_t *tcpd = tcp_data(tcph) + s->tx_pending;
+  uint32_t seq = s->local_seq;
+
+  if (data != tcpd) {
+    memcpy(tcpd, data, len);
+  }
+
+  len += s->tx_pending;
+  s->tx_pending = 0;
+
+  iph->len = iph->len + len;
+
+  tcph->flags |= flags;
 
   s->local_seq += len;
-  s->local_seq++;
+
+  if (flags & TCP_FIN) {
+    s->local_seq++;
+  }
 
   tcp_tx(iph);
+  tcp_tx_sent(s, seq);
+}
 
-  s->state = TCP_FIN_WAIT_1;
+void tcp_tx_data(struct tcp_sock *s, uint8_t *data, uint16_t len) {
+  tcp_tx_segment(s, data, len, TCP_ACK | TCP_PSH);
+}
+
+void tcp_tx_data_fin(struct tcp_sock *s, uint8_t *data, uint16_t len) {
+  tcp_tx_segment(s, data, len, TCP_ACK | TCP_PSH | TCP_FIN);
 
-  if (s->close) {
-    (*s->close)(s);
+  if (s->state == TCP_ESTABLISHED) {
+    s->state = TCP_FIN_WAIT_1;
+  } else if (s->state == TCP_CLOSE_WAIT) {
+    s->state = TCP_LAST_ACK;
   }
 }
 
+// Add "len" bytes to the next segment on "s" without sending it yet, like
+// MSG_MORE. It goes out once it's full, with the next call to tcp_tx_data()
+// or tcp_tx_data_fin(), or when the send callback returns.
+void tcp_tx_data_more(struct tcp_sock *s, uint8_t *data, uint16_t len) {
+  uint8_t *tcpd = tcp_tx_payload(s);
+
+  if (data != tcpd) {
+    memcpy(tcpd, data, len);
+  }
+
+  s->tx_pending += len;
+
+  if (s->tx_pending >= s->mss) {
+    tcp_tx_flush(s);
+  }
+}
+
+void tcp_tx_flush(struct tcp_sock *s) {
+  if (s->tx_pending) {
+    tcp_tx_segment(s, tcp_tx_payload(s), 0, TCP_ACK | TCP_PSH);
+  }
+}
+
+// Tell the peer the largest segment we take, on a SYN being built in "iph"
+void tcp_tx_mss(struct ip_hdr *iph) {
+  struct tcp_hdr *tcph = (struct tcp_hdr *)ip_data(iph);
+  uint8_t *opt = (uint8_t *)(tcph + 1);
+
+  opt[0] = TCP_OPT_MSS;
+  opt[1] = 4;
+  opt[2] = TCP_PACKET_LEN >> 8;
+  opt[3] = TCP_PACKET_LEN & 0xFF;
+
+  tcph->offset = 6;
+  iph->len = iph->len + 4;
+}
+
 void tcp_tx_syn(struct tcp_sock *s) {
   struct ip_hdr *iph = tcp_packet_init(s);
   struct tcp_hdr *tcph = (struct tcp_hdr *)ip_data(iph);
 
   tcph->flags |= TCP_SYN;
 
+  tcp_tx_mss(iph);
+
   tcp_tx(iph);
 }
 
@@ -503,6 +1433,32 @@ void tcp_tx_ack(struct tcp_sock *s) {
   tcp_tx(iph);
 }
 
+// A segment the peer has already acknowledged, which it answers with an ACK
+// carrying its current window
+void tcp_tx_probe(struct tcp_sock *s) {
+  struct ip_hdr *iph = tcp_packet_init(s);
+  struct tcp_hdr *tcph = (struct tcp_hdr *)ip_data(iph);
+
+  tcph->seq = s->local_una - 1;
+  tcph->flags |= TCP_ACK;
+
+  tcp_tx(iph);
+}
+
+// Hold back the ACK for received data in the hope it can ride on a reply.
+// Every second segment is acknowledged straight away, and the rest within
+// TCP_ACK_DELAY ticks.
+void tcp_tx_ack_later(struct tcp_sock *s) {
+  if (++s->ack_pending >= 2) {
+    tcp_tx_ack(s);
+  } else if (!(s->timers & TCP_TIMER_ACK)) {
+    s->timers |= TCP_TIMER_ACK;
+    s->ack_at = tcp_clock + TCP_ACK_DELAY;
+
+    tcp_timer_at(s, s->ack_at);
+  }
+}
+
 void tcp_tx_synack(struct tcp_sock *s) {
   struct ip_hdr *iph = tcp_packet_init(s);
   struct tcp_hdr *tcph = (struct tcp_hdr *)ip_data(iph);
@@ -510,9 +1466,23 @@ void tcp_tx_synack(struct tcp_sock *s) {
   tcph->flags |= TCP_SYN;
   tcph->flags |= TCP_ACK;
 
+  tcp_tx_mss(iph);
+
   tcp_tx(iph);
 }
 
+// Answer the peer's FIN with ours. The application has nothing more to send
+// once the peer has gone, so it's let go.
+void tcp_tx_fin_last(struct tcp_sock *s) {
+  tcp_tx_fin(s);
+
+  s->local_seq++;
+  s->state = TCP_LAST_ACK;
+
+  tcp_tx_sent(s, s->local_seq - 1);
+  tcp_sock_detach(s);
+}
+
 void tcp_tx_fin(struct tcp_sock *s) {
   struct ip_hdr *iph = tcp_packet_init(s);
   struct tcp_hdr *tcph = (struct tcp_hdr *)ip_data(iph);
@@ -528,6 +1498,7 @@ void tcp_tx_rst(struct tcp_sock *s) {
   struct tcp_hdr *tcph = (struct tcp_hdr *)ip_data(iph);
 
   tcph->flags |= TCP_RST;
+  tcph->win = 0;
 
   tcp_tx(iph);
 }
@@ -542,12 +1513,12 @@ void tcp_reject(struct ip_hdr *in_iph) {
   iph->proto = TCP;
   memcpy(iph->daddr, in_iph->saddr, 4);
 
-  tcph->sport = in_tcph->dport;
-  tcph->dport = in_tcph->sport;
+  tcph->sport = htons(in_tcph->dport);
+  tcph->dport = htons(in_tcph->sport);
   tcph->seq = in_tcph->ack_seq;
   tcph->ack_seq = in_tcph->seq + tcpd_len;
   tcph->offset = 5;
-  tcph->win = TCP_PACKET_LEN;
+  tcph->win = 0;
   tcph->flags |= TCP_RST;
 
   if (in_tcph->flags & TCP_FIN) {
@@ -564,14 +1535,13 @@ void tcp_close(struct tcp_sock *s) {
     s->local_seq++;
     s->state = TCP_FIN_WAIT_1;
 
-    if (s->close) {
-      (*s->close)(s);
-    }
+    tcp_tx_sent(s, s->local_seq - 1);
   }
 }
 
 void tcp_listen(
   uint16_t port,
+  uint8_t max_socks,
   void (*open)(struct tcp_sock *),
   void (*recv)(struct tcp_sock *, uint8_t *, uint16_t),
   void (*send)(struct tcp_sock *, uint16_t),
@@ -585,6 +1555,9 @@ void tcp_listen(
 
     if (l->port == 0) {
       l->port = port;
+      l->max_socks = max_socks;
+      l->socks = 0;
+      l->backlog_len = 0;
       l->open = open;
       l->recv = recv;
       l->send = send;
@@ -597,12 +1570,23 @@ void tcp_listen(
 void tcp_unlisten(uint16_t port) {
   struct tcp_listener *l;
   uint8_t i;
+  uint8_t j;
 
   for (i = 0; i < TCP_MAX_LISTENERS; i++) {
     l = &tcp_listen_table[i];
 
     if (l->port == port) {
       l->port = 0;
+
+      tcp_backlog_count -= l->backlog_len;
+      l->backlog_len = 0;
+
+      // Connections already open carry on, but no longer count against it
+      for (j = 0; j < TCP_MAX_SOCKETS; j++) {
+        if (tcp_sock_table[j].listener == l) {
+          tcp_sock_table[j].listener = NULL;
+        }
+      }
     }
   }
 }
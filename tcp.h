@@ -2,18 +2,50 @@
 #define __TCP_H__
 
 #define TCP_MAX_LISTENERS 4
+#define TCP_BACKLOG 4 // SYNs queued per listener while it's at its limit
+#define TCP_BACKLOG_TIMEOUT (40 * CLOCK_HZ) // Ticks before a queued SYN that hasn't been repeated is forgotten
+
+#ifndef TCP_MAX_SOCKETS
 #define TCP_MAX_SOCKETS 16
+#endif
+
+// Buckets in the socket lookup hash, a power of two. Keeping it at or above
+// TCP_MAX_SOCKETS keeps the chains short however many sockets there are.
+#ifndef TCP_SOCK_HASH
+#define TCP_SOCK_HASH 16
+#endif
+
+#define TCP_PACKET_LEN (SLIP_MTU - 20 - 20) // Our MSS: link MTU - 20 (IP header) - 20 (TCP header)
+#define TCP_DEFAULT_MSS 536 // Assumed for a peer that sends no MSS option (RFC 1122)
+#define TCP_TX_WINDOW (4 * TCP_PACKET_LEN) // Unacknowledged bytes allowed in flight per socket
+#define TCP_RX_HELD 2 // Out of order segments held until the gap before them is filled, shared by all sockets
 
-#define TCP_PACKET_LEN 536 // 576 MTU - 20 (IP header) - 20 (TCP header)
+// Timers are in tcp_clock ticks, which follow clock_ticks. Each socket
+// sits in the timer wheel under whichever of its timers is due first, and
+// a tick only looks at the slot for that tick. Deadlines are compared as
+// signed differences, so none can be more than 32767 ticks away.
+#define TCP_WHEEL_SLOTS 32 // A power of two
+#define TCP_IDLE_TICKS (30 * CLOCK_HZ) // Silence before a connection is dropped
+#define TCP_FIN_WAIT_TICKS (10 * CLOCK_HZ) // Wait in FIN_WAIT_2 for the peer's FIN
+#define TCP_RTO_INIT CLOCK_HZ
+#define TCP_RTO_MIN (CLOCK_HZ / 5)
+#define TCP_RTO_MAX (60 * CLOCK_HZ)
+#define TCP_MAX_RETRIES 6
+#define TCP_DUP_ACKS 3 // Duplicate ACKs that trigger a fast retransmit
+#define TCP_ACK_DELAY (CLOCK_HZ / 5) // Ticks an ACK can wait for a reply to ride on
 
-#define TCP_TIMEOUT_TICKS 200
+#define TCP_TIMER_RTX 0x01
+#define TCP_TIMER_ACK 0x02
+#define TCP_TIMER_PERSIST 0x04 // Probe a peer whose window is shut
+
+#define tcp_due(at) ((int16_t)(tcp_clock - (at)) >= 0)
 
 #define TCP_CLOSED 0
 #define TCP_LISTEN 1
 #define TCP_SYN_RCVD 2
 #define TCP_SYN_SENT 3
 #define TCP_ESTABLISHED 4
-// #define TCP_CLOSE_WAIT 5
+#define TCP_CLOSE_WAIT 5 // Peer's FIN arrived mid-resend, ours waits until that's done
 #define TCP_LAST_ACK 6
 #define TCP_FIN_WAIT_1 7
 #define TCP_FIN_WAIT_2 8
@@ -29,8 +61,17 @@
 #define TCP_ECN 0x40
 #define TCP_WIN 0x80
 
+#define TCP_OPT_END 0
+#define TCP_OPT_NOP 1
+#define TCP_OPT_MSS 2
+
 #define tcp_hl(tcph) (tcph->offset * 4)
 
+// Hash bucket of the connection with a peer at "addr", from the peer's port
+// "rport" and our port "lport" in host order
+#define tcp_hash(addr, rport, lport) \
+  (((addr)[3] ^ (rport) ^ ((rport) >> 8) ^ (lport) ^ ((lport) >> 8)) & (TCP_SOCK_HASH - 1))
+
 struct tcp_hdr {
   uint16_t sport;
   uint16_t dport;
@@ -44,16 +85,37 @@ struct tcp_hdr {
   uint16_t urp;
 };
 
-struct tcp_psuedo_hdr {
-  uint8_t saddr[4];
-  uint8_t daddr[4];
-  uint8_t reserved;
-  uint8_t proto;
+// IP and TCP headers for every segment on a socket, in network byte order.
+// tcp.csum holds the sum of the ports and pseudo-header addresses.
+struct tcp_template {
+  struct ip_hdr ip;
+  struct tcp_hdr tcp;
+};
+
+// A segment that arrived ahead of the one expected
+struct tcp_held {
+  struct tcp_sock *s; // NULL when the slot is free
+  uint32_t seq;
   uint16_t len;
+  uint8_t flags;
+  uint8_t data[TCP_PACKET_LEN];
+};
+
+// A SYN waiting for a socket to answer it with
+struct tcp_pending {
+  uint8_t addr[4];
+  uint16_t port;
+  uint32_t seq;
+  uint16_t mss;
+  uint16_t clock; // tcp_clock when last seen
 };
 
 struct tcp_listener {
   uint16_t port;
+  uint8_t max_socks; // Most connections open at once, 0 for no limit
+  uint8_t socks;
+  uint8_t backlog_len;
+  struct tcp_pending backlog[TCP_BACKLOG];
   void (*open)(struct tcp_sock *);
   void (*recv)(struct tcp_sock *, uint8_t *, uint16_t);
   void (*send)(struct tcp_sock *, uint16_t);
@@ -67,10 +129,34 @@ struct tcp_sock {
   uint16_t dport;
   uint8_t state;
   uint8_t conn_id;
+  struct tcp_sock *hash_next;
+  struct tcp_listener *listener; // Counts against this listener's max_socks while set
+  struct tcp_sock *timer_next;
+  uint16_t timer_at;  // Wheel slot deadline, the earliest of the ones below
+  uint16_t idle_at;
+  uint16_t rtx_at;    // Oldest unacknowledged segment is resent
+  uint16_t ack_at;    // Held back ACK is sent anyway
+  uint16_t persist_at; // Next zero window probe
+  uint8_t timers;     // TCP_TIMER_* running besides the idle timer
   uint32_t local_isn;
   uint32_t local_seq;
+  uint32_t local_una; // Oldest sequence number not yet acknowledged
+  uint32_t local_max; // Highest sequence number sent, ahead of local_seq while resending
   uint32_t remote_seq;
-  uint16_t ticks;
+  uint16_t remote_win;
+  uint16_t rx_win;    // Window we advertise, what the application has room for
+  uint16_t mss;       // Largest segment payload the peer takes
+  uint16_t tx_pending; // Bytes corked in the next segment
+  uint32_t rtt_seq;   // Segment being timed for the RTT estimate
+  uint16_t rtt_start;
+  uint8_t rtt_timing;
+  uint16_t srtt;      // Smoothed RTT, scaled by 8
+  uint16_t rttvar;    // RTT variation, scaled by 4
+  uint16_t rto;
+  uint8_t retries;
+  uint8_t dup_acks;
+  uint8_t ack_pending; // Segments received since we last acknowledged
+  struct tcp_template tmpl;
   void (*open)(struct tcp_sock *);
   void (*recv)(struct tcp_sock *, uint8_t *, uint16_t);
   void (*send)(struct tcp_sock *, uint16_t);
@@ -81,24 +167,74 @@ void tcp_debug(struct ip_hdr *iph);
 uint8_t *tcp_data(struct tcp_hdr *tcph);
 uint16_t tcp_data_len(struct ip_hdr *iph, struct tcp_hdr *tcph);
 void tcp_init(void);
+uint16_t tcp_checksum(struct ip_hdr *iph, uint8_t *data, uint16_t len);
 struct tcp_sock *tcp_sock_init(struct ip_hdr *iph);
+struct tcp_sock *tcp_sock_free(void);
+struct tcp_sock *tcp_sock_new(struct tcp_listener *l, uint8_t *addr, uint16_t port);
+struct tcp_listener *tcp_listener_get(uint16_t port);
+void tcp_backlog_add(struct tcp_listener *l, struct ip_hdr *iph);
+void tcp_backlog_accept(void);
 struct tcp_sock *tcp_sock_get(struct ip_hdr *iph);
-void tcp_tick(void);
+void tcp_sock_hash_add(struct tcp_sock *s);
+void tcp_sock_hash_remove(struct tcp_sock *s);
+void tcp_sock_template(struct tcp_sock *s);
+void tcp_poll(void);
+void tcp_timer(void);
+void tcp_timer_fire(struct tcp_sock *s);
+void tcp_timer_at(struct tcp_sock *s, uint16_t at);
+void tcp_timer_update(struct tcp_sock *s);
+void tcp_wheel_add(struct tcp_sock *s);
+void tcp_wheel_remove(struct tcp_sock *s);
+void tcp_idle_reset(struct tcp_sock *s);
+void tcp_rtx_start(struct tcp_sock *s);
 struct ip_hdr *tcp_packet_init(struct tcp_sock *s);
 void tcp_sock_close(struct tcp_sock *s);
+void tcp_sock_detach(struct tcp_sock *s);
 void tcp_rx(struct ip_hdr *iph);
+uint16_t tcp_rx_mss(struct tcp_hdr *tcph);
+void tcp_rx_syn(struct tcp_sock *s, uint32_t seq, uint16_t mss);
+void tcp_rx_data(struct tcp_sock *s, uint8_t *data, uint16_t len, uint8_t flags);
+void tcp_rx_hold(struct tcp_sock *s, struct tcp_hdr *tcph, uint8_t *data, uint16_t len);
+struct tcp_held *tcp_rx_held_next(struct tcp_sock *s);
+void tcp_rx_held_free(struct tcp_sock *s);
+uint8_t tcp_rx_ack(struct tcp_sock *s, struct tcp_hdr *tcph, uint16_t len);
+void tcp_rx_acked(struct tcp_sock *s, uint8_t acked);
+void tcp_rtt_sample(struct tcp_sock *s, uint16_t rtt);
+void tcp_rto_reset(struct tcp_sock *s);
+void tcp_rto_backoff(struct tcp_sock *s);
+uint16_t tcp_tx_window(struct tcp_sock *s);
+void tcp_tx_more(struct tcp_sock *s);
+uint8_t tcp_tx_data_lost(struct tcp_sock *s);
+void tcp_tx_sent(struct tcp_sock *s, uint32_t seq);
+void tcp_tx_resend(struct tcp_sock *s);
+void tcp_tx_timeout(struct tcp_sock *s);
+uint8_t tcp_tx_stalled(struct tcp_sock *s);
+void tcp_tx_persist(struct tcp_sock *s);
+void tcp_tx_probe(struct tcp_sock *s);
+void tcp_rx_window(struct tcp_sock *s, uint16_t space);
+uint32_t tcp_tx_offset(struct tcp_sock *s);
+uint8_t tcp_tx_acked(struct tcp_sock *s);
 void tcp_tx(struct ip_hdr *iph);
+uint8_t *tcp_tx_payload(struct tcp_sock *s);
+uint16_t tcp_tx_space(struct tcp_sock *s);
+void tcp_tx_segment(struct tcp_sock *s, uint8_t *data, uint16_t len, uint8_t flags);
 void tcp_tx_data(struct tcp_sock *s, uint8_t *data, uint16_t len);
 void tcp_tx_data_fin(struct tcp_sock *s, uint8_t *data, uint16_t len);
+void tcp_tx_data_more(struct tcp_sock *s, uint8_t *data, uint16_t len);
+void tcp_tx_flush(struct tcp_sock *s);
+void tcp_tx_mss(struct ip_hdr *iph);
 void tcp_tx_syn(struct tcp_sock *s);
 void tcp_tx_ack(struct tcp_sock *s);
+void tcp_tx_ack_later(struct tcp_sock *s);
 void tcp_tx_synack(struct tcp_sock *s);
 void tcp_tx_fin(struct tcp_sock *s);
+void tcp_tx_fin_last(struct tcp_sock *s);
 void tcp_tx_rst(struct tcp_sock *s);
 void tcp_reject(struct ip_hdr *in_iph);
 void tcp_close(struct tcp_sock *s);
 void tcp_listen(
   uint16_t port,
+  uint8_t max_socks,
   void (*open)(struct tcp_sock *),
   void (*recv)(struct tcp_sock *, uint8_t *, uint16_t),
   void (*send)(struct tcp_sock *, uint16_t),
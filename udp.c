@@ -36,20 +36,7 @@ uint8_t *udp_data(struct udp_hdr *udph) {
 }
 
 uint16_t udp_checksum(struct ip_hdr *iph, uint8_t *data, uint16_t len) {
-  struct udp_pseudo_hdr hdr;
-  uint16_t sum;
-
-  memset(&hdr, 0, sizeof(struct udp_pseudo_hdr));
-
-  memcpy(hdr.saddr, iph->saddr, 4);
-  memcpy(hdr.daddr, iph->daddr, 4);
-
-  hdr.proto = iph->proto;
-  hdr.len = htons(len);
-
-  sum = ~checksum((uint16_t *)&hdr, sizeof(struct udp_pseudo_hdr), 0);
-
-  return checksum((uint16_t *)data, len, sum);
+  return checksum((uint16_t *)data, len, checksum_pseudo(iph, len));
 }
 
 void udp_rx(struct ip_hdr *iph) {
@@ -66,7 +53,7 @@ void udp_rx(struct ip_hdr *iph) {
   }
 
   if (udph->csum != 0) {
-    csum = udp_checksum(iph, (uint8_t *)udph, udp_len);
+    csum = ip_rx_data_checksum(iph, udp_len, checksum_pseudo(iph, udp_len));
     if (csum != 0) {
       return;
     }
@@ -12,14 +12,6 @@ struct udp_hdr {
   uint16_t csum;
 };
 
-struct udp_pseudo_hdr {
-  uint8_t saddr[4];
-  uint8_t daddr[4];
-  uint8_t reserved;
-  uint8_t proto;
-  uint16_t len;
-};
-
 struct udp_binding {
   uint16_t port;
   void (*recv)(struct ip_hdr *);